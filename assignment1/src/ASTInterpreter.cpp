@@ -1,208 +1,396 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
 //===----------------------------------------------------------------------===//
 
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/EvaluatedExprVisitor.h"
-#include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendAction.h"
-#include "clang/Tooling/Tooling.h"
-#include "clang/AST/ASTContext.h"
-
-using namespace clang;
-
-#include "Environment.h"
-
-class InterpreterVisitor : 
-   public EvaluatedExprVisitor<InterpreterVisitor> {
-public:
-   explicit InterpreterVisitor(const ASTContext &context, Environment * env)
-   : EvaluatedExprVisitor(context), mEnv(env), mCtx(context) {}
-   virtual ~InterpreterVisitor() {}
-
-   virtual void VisitBinaryOperator (BinaryOperator * bop) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving binary operator expr\n";
-	   VisitStmt(bop);
-       mEnv->binop(bop);
-       Diag << "finished solving binary operator expr\n";
-   }
-   virtual void VisitDeclRefExpr(DeclRefExpr * expr) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving decl ref expr\n";
-	   VisitStmt(expr);
-	   mEnv->declref(expr);
-       Diag << "finished solving decl ref expr\n";
-   }
-   virtual void VisitCastExpr(CastExpr * expr) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving cast expr\n";
-	   VisitStmt(expr);
-	   mEnv->cast(expr);
-       Diag << "finished solving cast expr\n";
-   }
-   virtual void VisitCallExpr(CallExpr * call) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving call expr\n";
-	   VisitStmt(call);
-	   mEnv->call(call);
-
-       FunctionDecl* callee = call->getDirectCallee();
-       if (callee->hasBody()) { 
-           VisitStmt(callee->getBody());
-            mEnv->popStack();
-       }
-       Diag << "finished solving call expr\n";
-   }
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
-   virtual void VisitDeclStmt(DeclStmt * declstmt) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving decl stmt\n";
-	   mEnv->decl(declstmt);
-       Diag << "finished solving decl stmt\n";
-   }
-    
-   Stmt* wrapStmt(Stmt* stmt) {
-       if (!isa<CompoundStmt>(stmt)) 
-           return CompoundStmt::Create(mCtx, stmt, SourceLocation(), SourceLocation());
-       return stmt;
-   }
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 
-   virtual void VisitIfStmt(IfStmt* ifstmt) {
-        if (mEnv->isReturned()) return;
-        Diag << "solving if stmt\n";
-
-        Stmt* cond = wrapStmt(ifstmt->getCond());
-        VisitStmt(cond);
-
-        int val = mEnv->cond(ifstmt->getCond());
-        Stmt* br = NULL;
-        
-        if (val) { 
-            Diag << "\ttrue branch\n";
-            br = ifstmt->getThen();
-        } else if (ifstmt->hasElseStorage()) {
-            Diag << "\tfalse branch\n";
-            br = ifstmt->getElse();
-        }
-        
-        if (br) {
-            VisitStmt(wrapStmt(br));
-        }
-       Diag << "finished solving if stmt\n";
-   }
+#include "CompiledProgram.h"
+#include "ForkServer.h"
+#include "Scheduler.h"
+#include "ThreadPool.h"
 
-   virtual void VisitReturnStmt(ReturnStmt* retstmt) {
-       if (mEnv->isReturned()) return;
-        Diag << "solving return stmt\n";
-        VisitStmt(retstmt);
-        mEnv->mreturn(retstmt);
-       Diag << "finished solving return stmt\n";
-   }
-   
-   virtual void VisitUnaryOperator (UnaryOperator * uop) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving unary operator expr\n";
-	   VisitStmt(uop);
-       mEnv->uniop(uop);
-       Diag << "finished solving unary operator expr\n";
-   }
+static llvm::cl::opt<std::string> SourceCode(llvm::cl::Positional,
+   llvm::cl::desc("<source code>"));
+
+static llvm::cl::opt<unsigned> MaxCallDepth("max-call-depth",
+   llvm::cl::desc("Maximum depth of calls in the interpreted program"),
+   llvm::cl::init(unsigned(VMOptions::kDefaultMaxDepth)));
+
+static llvm::cl::opt<bool> NoOptimize("no-optimize",
+   llvm::cl::desc("Run the bytecode as lowered, without the optimizer"));
+
+static llvm::cl::opt<bool> OptimizerReport("optimizer-stats",
+   llvm::cl::desc("Report what the optimizer removed"));
+
+static llvm::cl::opt<bool> NoJit("no-jit",
+   llvm::cl::desc("Interpret every function, never compile to native code"));
+
+static llvm::cl::opt<unsigned> JitThreshold("jit-threshold",
+   llvm::cl::desc("Calls plus loop iterations after which a function is compiled"),
+   llvm::cl::init(unsigned(VMOptions::kDefaultJitThreshold)));
+
+static llvm::cl::opt<std::string> Batch("batch",
+   llvm::cl::desc("Run every source and input listed in a manifest file in one process"),
+   llvm::cl::value_desc("manifest"));
+
+static llvm::cl::opt<bool> Interleave("interleave",
+   llvm::cl::desc("Run the --batch executions as coroutines on one thread, so one waiting for input, like a pipe, does not hold up the others"));
+
+static llvm::cl::opt<std::string> CacheDir("cache-dir",
+   llvm::cl::desc("Reuse the programs compiled by earlier runs with the same directory and add to it"),
+   llvm::cl::value_desc("directory"));
+
+static llvm::cl::opt<bool> NoPrompt("no-prompt",
+   llvm::cl::desc("Let GET read its input without asking for it"));
+
+static llvm::cl::opt<bool> Memoize("memoize",
+   llvm::cl::desc("Reuse the results of calls of pure functions"));
+
+static llvm::cl::opt<unsigned> MemoEntries("memo-entries",
+   llvm::cl::desc("Results --memoize remembers at most"),
+   llvm::cl::init(unsigned(MemoTable::kDefaultEntries)));
+
+static llvm::cl::opt<bool> MemoReport("memo-stats",
+   llvm::cl::desc("Report memo hits and misses after the run"));
+
+static llvm::cl::opt<bool> HeapReport("heap-stats",
+   llvm::cl::desc("Report live, peak and slab bytes of the MALLOC heap after the run"));
+
+static llvm::cl::opt<bool> GuardPages("guard-pages",
+   llvm::cl::desc("Give every MALLOC block guard pages and report out-of-bounds and use-after-FREE accesses with their line"));
+
+static llvm::cl::opt<unsigned> MemorySize("memory-size",
+   llvm::cl::desc("Megabytes of address space every execution reserves for the program's memory, at most 4096; a smaller size fits more --interleave executions"),
+   llvm::cl::init(unsigned(Memory::kReserve >> 20)));
+
+static llvm::cl::opt<bool> Profile("profile",
+   llvm::cl::desc("Interpret the whole run and report calls, time and executed lines per function"));
+
+static llvm::cl::opt<std::string> ProfileFile("profile-file",
+   llvm::cl::desc("Also write the --profile report as JSON to a file"),
+   llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> SampleFile("sample",
+   llvm::cl::desc("Sample the interpreted call stack and write folded stacks for flame graphs to a file"),
+   llvm::cl::value_desc("file"));
 
-   virtual void VisitWhileStmt(WhileStmt* wstmt) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving while stmt\n";
-    
-       Stmt* cond = wrapStmt(wstmt->getCond());
-        VisitStmt(cond);
-        
-        int val = mEnv->cond(wstmt->getCond());
-
-        while (val) {
-            VisitStmt(wstmt->getBody());
-            VisitStmt(cond);
-            val = mEnv->cond(wstmt->getCond());
-        }
-        Diag << "finished solving while stmt\n";
+static llvm::cl::opt<unsigned> SampleRate("sample-rate",
+   llvm::cl::desc("Samples --sample takes per second of CPU time"),
+   llvm::cl::init(unsigned(Sampler::kDefaultRate)));
+
+static llvm::cl::opt<std::string> TraceFile("trace",
+   llvm::cl::desc("Trace calls, loops, memory and IO and write them as Chrome trace JSON to a file at exit and on SIGUSR1"),
+   llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> ForkInputs("fork-inputs",
+   llvm::cl::desc("Run the source once up to its first GET, then fork it for every input file listed in a file"),
+   llvm::cl::value_desc("list"));
+
+static llvm::cl::opt<unsigned> Jobs("jobs",
+   llvm::cl::desc("Threads running the --batch executions or processes running the --fork-inputs ones, one per core by default"),
+   llvm::cl::init(0));
+
+/// PRINT output is buffered, a fatal error must not swallow it
+#if LLVM_VERSION_MAJOR >= 14
+static void flushOutput(void * out, const char * reason, bool) {
+#else
+static void flushOutput(void * out, const std::string & reason, bool) {
+#endif
+   ((llvm::raw_ostream *) out)->flush();
+   llvm::errs() << "LLVM ERROR: " << reason << "\n";
+}
+
+static const size_t kOutputBufferBytes = 1 << 16;
+
+/// Write the --trace file, while the programs it names still exist
+static void writeTrace() {
+   if (!TraceFile.empty() && !Tracer::instance().write(TraceFile))
+      llvm::errs() << TraceFile << ": cannot write the trace\n";
+}
+
+/// One line of a batch manifest
+struct BatchRun {
+   llvm::StringRef source;
+   llvm::StringRef input;
+   const CompiledProgram * program;
+   std::string output;
+   std::string error;
+};
+
+/// Run \p run, relative paths being in \p dir
+static void runOne(BatchRun & run, const VMOptions & options, llvm::StringRef dir) {
+   std::unique_ptr<Input> in(new StringInput(""));
+   if (!run.input.empty()) {
+      llvm::SmallString<128> name(run.input);
+      llvm::sys::fs::make_absolute(dir, name);
+      in = FileInput::open(name.str().str());
+      if (!in) {
+         run.error = "cannot open " + run.input.str();
+         return;
+      }
    }
+   llvm::raw_string_ostream os(run.output);
+   run.program->execute(*in, os, options);
+}
 
-   virtual void VisitForStmt(ForStmt* forstmt) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving for stmt\n";
-       Stmt* init = forstmt->getInit();
-       if (init) VisitStmt(wrapStmt(init));
-
-       Stmt* cond = forstmt->getCond();
-       if (cond) VisitStmt(wrapStmt(cond));
-      
-       int val = mEnv->cond(forstmt->getCond());
-       Expr* inc = forstmt->getInc();
-       while (val) {
-           VisitStmt(forstmt->getBody());
-           if (inc) VisitStmt(wrapStmt(inc));
-           if (cond) VisitStmt(wrapStmt(cond));
-            val = mEnv->cond(forstmt->getCond());
-       }
-       Diag << "finished solving for stmt\n";
+/// The input of an interleaved batch run, pushed to its Channel as the
+/// file has data
+struct Feed {
+   int fd;                   /// -1 once the input has ended
+   Channel channel;
+};
+
+/// Run \p runs as the executions of one Scheduler, relative paths being
+/// in \p dir.  The input files are read without blocking whenever poll()
+/// finds data in them, so a run waiting for a pipe lets the others go on.
+static void runInterleaved(std::vector<BatchRun> & runs, const VMOptions & options,
+                           llvm::StringRef dir) {
+   Scheduler scheduler;
+   std::vector<std::unique_ptr<Feed>> feeds;
+   std::vector<std::unique_ptr<llvm::raw_string_ostream>> outputs;
+   for (BatchRun & run : runs) {
+      if (!run.program) continue;
+      std::unique_ptr<Feed> feed(new Feed());
+      feed->fd = -1;
+      if (!run.input.empty()) {
+         llvm::SmallString<128> name(run.input);
+         llvm::sys::fs::make_absolute(dir, name);
+         feed->fd = open(name.c_str(), O_RDONLY | O_NONBLOCK);
+         if (feed->fd < 0) {
+            run.error = "cannot open " + run.input.str();
+            continue;
+         }
+      } else {
+         feed->channel.close();
+      }
+      outputs.emplace_back(new llvm::raw_string_ostream(run.output));
+      scheduler.spawn(run.program->program(), options, feed->channel, *outputs.back());
+      feeds.push_back(std::move(feed));
    }
 
-   virtual void VisitArraySubscriptExpr(ArraySubscriptExpr* arrExpr) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving array subscript expr\n";
-       Expr* index = arrExpr->getIdx();
-       VisitStmt(wrapStmt(index));
-       Diag << "finished solving array subscript expr\n";
+   /// Every execution left after run() waits for an input still open
+   char block[1 << 16];
+   for (scheduler.run(); scheduler.size(); scheduler.run()) {
+      std::vector<pollfd> fds;
+      std::vector<Feed *> polled;
+      for (std::unique_ptr<Feed> & feed : feeds) {
+         if (feed->fd < 0) continue;
+         pollfd fd = { feed->fd, POLLIN, 0 };
+         fds.push_back(fd);
+         polled.push_back(feed.get());
+      }
+      if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+         llvm::report_fatal_error("cannot poll the batch inputs");
+      for (size_t i = 0; i < fds.size(); ++i) {
+         if (!fds[i].revents) continue;
+         Feed * feed = polled[i];
+         ssize_t bytes = read(feed->fd, block, sizeof(block));
+         if (bytes > 0) {
+            feed->channel.push(llvm::StringRef(block, bytes));
+         } else if (!bytes || (errno != EAGAIN && errno != EINTR)) {
+            close(feed->fd);
+            feed->fd = -1;
+            feed->channel.close();
+         }
+      }
    }
+   for (std::unique_ptr<Feed> & feed : feeds)
+      if (feed->fd >= 0) close(feed->fd);
+}
 
-   virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr* expr) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving unary expr or type trait expr\n";
-       assert(expr->getKind() == UETT_SizeOf && expr->isArgumentType());
-       mEnv->msizeof(expr);
-       Diag << "finished solving unary expr or type trait expr\n";
+/// Compile every source named in the manifest \p path once and run it
+/// once per line naming it.  A line holds a source file and optionally a
+/// file for GET to read, which otherwise reads nothing; relative paths are
+/// taken from the manifest's directory and blank lines and lines starting
+/// with '#' are skipped.
+///
+/// The sources are compiled and completed one after the other, then the
+/// runs share the complete programs and go to a pool of \p jobs threads.
+/// With --interleave, the runs are coroutines on this thread instead, see
+/// runInterleaved().  A source that cannot be compiled, or has a function
+/// that cannot be lowered, fails each of its runs without running it.
+///
+/// Each run prints one line once all are done, in the order of the
+/// manifest: the source and input followed by what the program PRINTed,
+/// or by the error that kept it from running.  A fatal error of a program
+/// still ends the whole batch.
+static int runBatch(llvm::StringRef path, const VMOptions & options,
+                    const ProgramCache * cache, unsigned jobs) {
+   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> manifest =
+      llvm::MemoryBuffer::getFile(path);
+   if (!manifest) {
+      llvm::errs() << path << ": " << manifest.getError().message() << "\n";
+      return 1;
    }
+   llvm::StringRef dir = llvm::sys::path::parent_path(path);
+   llvm::StringMap<std::unique_ptr<CompiledProgram>> programs;
+   /// Why a source could not be compiled
+   llvm::StringMap<std::string> errors;
+   std::vector<BatchRun> runs;
+   llvm::SmallVector<llvm::StringRef, 64> lines;
+   (*manifest)->getBuffer().split(lines, '\n');
+   for (llvm::StringRef line : lines) {
+      line = line.trim();
+      if (line.empty() || line.startswith("#")) continue;
+      std::pair<llvm::StringRef, llvm::StringRef> fields = llvm::getToken(line);
+      BatchRun run = { fields.first, llvm::getToken(fields.second).first, NULL, "", "" };
 
-   virtual void VisitParenExpr(ParenExpr* expr) {
-       if (mEnv->isReturned()) return;
-       Diag << "solving paren expr\n";
-       VisitStmt(expr);
-       mEnv->paren(expr);
-       Diag << "finished solving paren expr\n";
+      llvm::StringMap<std::unique_ptr<CompiledProgram>>::iterator it = programs.find(run.source);
+      if (it == programs.end()) {
+         llvm::SmallString<128> file(run.source);
+         llvm::sys::fs::make_absolute(dir, file);
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> code =
+            llvm::MemoryBuffer::getFile(file);
+         std::unique_ptr<CompiledProgram> compiled;
+         std::string error;
+         if (code)
+            compiled = CompiledProgram::compile((*code)->getBuffer().str(), !NoOptimize, cache,
+                                                &error);
+         if (compiled && !compiled->complete(&error)) compiled.reset();
+         if (!error.empty()) errors[run.source] = error;
+         it = programs.insert(std::make_pair(run.source, std::move(compiled))).first;
+      }
+      run.program = it->second.get();
+      if (!run.program) {
+         run.error = "cannot compile";
+         llvm::StringMap<std::string>::iterator why = errors.find(run.source);
+         if (why != errors.end()) run.error += ": " + why->second;
+      }
+      runs.push_back(run);
    }
 
-private:
-   Environment * mEnv;
-   const ASTContext& mCtx;
-};
+   if (Interleave) {
+      runInterleaved(runs, options, dir);
+   } else {
+      ThreadPool pool(jobs);
+      for (BatchRun & run : runs)
+         if (run.program)
+            pool.submit([&run, &options, dir] { runOne(run, options, dir); });
+      pool.wait();
+   }
 
-class InterpreterConsumer : public ASTConsumer {
-public:
-   explicit InterpreterConsumer(const ASTContext& context) : mEnv(),
-   	   mVisitor(context, &mEnv) {
+   int failed = 0;
+   for (BatchRun & run : runs) {
+      llvm::outs() << run.source;
+      if (!run.input.empty()) llvm::outs() << ' ' << run.input;
+      if (run.error.empty()) {
+         llvm::outs() << ": " << run.output << '\n';
+      } else {
+         llvm::outs() << ": error: " << run.error << '\n';
+         ++failed;
+      }
    }
-   virtual ~InterpreterConsumer() {}
-
-   virtual void HandleTranslationUnit(clang::ASTContext &Context) {
-	   TranslationUnitDecl * decl = Context.getTranslationUnitDecl();
-	   mEnv.init(decl);
-
-	   FunctionDecl * entry = mEnv.getEntry();
-	   mVisitor.VisitStmt(entry->getBody());
-  }
-private:
-   Environment mEnv;
-   InterpreterVisitor mVisitor;
-};
+   writeTrace();
+   return failed ? 1 : 0;
+}
 
-class InterpreterClassAction : public ASTFrontendAction {
-public: 
-  virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
-    clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-    return std::unique_ptr<clang::ASTConsumer>(
-        new InterpreterConsumer(Compiler.getASTContext()));
-  }
-};
+/// Run \p compiled for every input file listed in \p path, one per line
+/// and relative to its directory, by forking it at its first GET.  Every
+/// input gets a line like in a batch: the input followed by what the
+/// program PRINTed for it.  GET does not prompt, since the prompts would
+/// end up in the output.  The reports and the trace cover the run up to
+/// the fork, see ForkServer.
+static int runForked(CompiledProgram & compiled, llvm::StringRef path,
+                     const VMOptions & options, unsigned jobs) {
+   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> list =
+      llvm::MemoryBuffer::getFile(path);
+   if (!list) {
+      llvm::errs() << path << ": " << list.getError().message() << "\n";
+      return 1;
+   }
+   llvm::StringRef dir = llvm::sys::path::parent_path(path);
+   std::vector<std::string> inputs;
+   std::vector<std::string> names;
+   llvm::SmallVector<llvm::StringRef, 64> lines;
+   (*list)->getBuffer().split(lines, '\n');
+   for (llvm::StringRef line : lines) {
+      line = line.trim();
+      if (line.empty() || line.startswith("#")) continue;
+      llvm::SmallString<128> file(line);
+      llvm::sys::fs::make_absolute(dir, file);
+      inputs.push_back(file.str().str());
+      names.push_back(line.str());
+   }
+   if (!jobs) jobs = std::thread::hardware_concurrency();
+   /// Children must not inherit output the parent has yet to write
+   llvm::outs().flush();
+   ForkServer server(inputs, names, jobs, llvm::outs());
+   VMOptions forked = options;
+   forked.prompt = false;
+   VM vm(compiled.program(), forked, server, server.output());
+   server.onSnapshot([&vm] {
+      vm.report();
+      writeTrace();
+   });
+   llvm::install_fatal_error_handler(flushOutput, &server.output());
+   vm.run();
+   llvm::remove_fatal_error_handler();
+   /// Only a child or a run that never read input gets here
+   if (server.isChild()) {
+      server.output().flush();
+      return 0;
+   }
+   server.report();
+   return 0;
+}
 
 int main (int argc, char ** argv) {
-   if (argc > 1) {
-       clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+   llvm::cl::ParseCommandLineOptions(argc, argv, "AST interpreter\n");
+   VMOptions options;
+   options.maxDepth = MaxCallDepth;
+   options.jit = !NoJit;
+   options.jitThreshold = JitThreshold;
+   options.prompt = !NoPrompt;
+   options.memoize = Memoize;
+   options.memoEntries = MemoEntries;
+   options.memoStats = MemoReport;
+   options.heapStats = HeapReport;
+   options.guard = GuardPages;
+   options.memoryBytes = LL(MemorySize) << 20;
+   options.profile = Profile;
+   options.profileFile = ProfileFile;
+   if (!SampleFile.empty()) {
+      if (!SampleRate) {
+         llvm::errs() << "--sample-rate has to be at least 1\n";
+         return 1;
+      }
+      options.sampleRate = SampleRate;
+   }
+   options.sampleFile = SampleFile;
+   if (!TraceFile.empty()) Tracer::instance().enable(TraceFile);
+   std::unique_ptr<ProgramCache> cache;
+   if (!CacheDir.empty()) cache.reset(new ProgramCache(CacheDir));
+   if (!Batch.empty()) return runBatch(Batch, options, cache.get(), Jobs);
+   if (!SourceCode.empty()) {
+       std::string error;
+       std::unique_ptr<CompiledProgram> compiled =
+          CompiledProgram::compile(SourceCode, !NoOptimize, cache.get(), &error);
+       if (!compiled) {
+          if (!error.empty()) llvm::errs() << "cannot compile: " << error << "\n";
+          return 1;
+       }
+       if (DEBUG) compiled->program().dump(llvm::errs());
+       if (!ForkInputs.empty()) return runForked(*compiled, ForkInputs, options, Jobs);
+       /// PRINT goes to stderr like before, through a large buffer
+       llvm::raw_fd_ostream out(STDERR_FILENO, false);
+       out.SetBufferSize(kOutputBufferBytes);
+       llvm::install_fatal_error_handler(flushOutput, &out);
+       compiled->run(Input::standard(), out, options);
+       out.flush();
+       llvm::remove_fatal_error_handler();
+       writeTrace();
+       /// Functions are optimized as they are lowered, so report afterwards
+       if (OptimizerReport && !NoOptimize) compiled->optimizerStats().print(llvm::errs());
    }
 }
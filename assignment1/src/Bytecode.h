@@ -0,0 +1,182 @@
+//==--- Bytecode.h - Register bytecode executed by the interpreter ---------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODE_H
+#define AST_INTERPRETER_BYTECODE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+typedef long long LL;
+#define DEBUG  0
+#define Diag if (DEBUG) llvm::errs()
+
+/// Every FunctionDecl body is lowered once into a flat array of
+/// three-address instructions.  Operands named r* are registers of the
+/// current frame, which holds the variable slots followed by the
+/// temporaries, g* are slots of the global area, and jump targets are
+/// instruction indices.  Addresses are offsets into the Memory of the
+/// running program.  The opcodes from OP_ADDK to OP_JNEK are
+/// superinstructions only the Optimizer emits.
+enum Opcode : uint8_t {
+   OP_NOP,
+   OP_LOADK,      /// ra = consts[b]
+   OP_MOV,        /// ra = rb
+   OP_LOADGLOBAL, /// ra = gb
+   OP_STOREGLOBAL, /// ga = rb
+   OP_FRAMEADDR,  /// ra = address of byte b of the call's data frame
+   OP_ZERO,       /// zero b bytes at address ra
+   OP_LOAD8,      /// ra = *(char *) rb
+   OP_LOAD32,     /// ra = *(int *) rb
+   OP_LOAD64,     /// ra = *(T **) rb
+   OP_STORE8,     /// *(char *) ra = rb
+   OP_STORE32,    /// *(int *) ra = rb
+   OP_STORE64,    /// *(T **) ra = rb
+   OP_SEXT8,      /// ra = (char) rb
+   OP_SEXT32,     /// ra = (int) rb
+   OP_NEG,        /// ra = -rb
+   OP_NOT,        /// ra = ~rb
+   OP_LNOT,       /// ra = !rb
+   OP_ADD,        /// ra = rb + rc, and so on up to OP_NE
+   OP_SUB,
+   OP_MUL,
+   OP_DIV,
+   OP_REM,
+   OP_SHL,
+   OP_SHR,
+   OP_AND,
+   OP_OR,
+   OP_XOR,
+   OP_LT,
+   OP_GT,
+   OP_LE,
+   OP_GE,
+   OP_EQ,
+   OP_NE,
+   OP_JMP,        /// goto a
+   OP_JZ,         /// if (!ra) goto b
+   OP_JNZ,        /// if (ra) goto b
+   OP_ADDK,       /// ra = rb + c, c an immediate
+   OP_MULK,       /// ra = rb * c
+   OP_JLT,        /// if (ra < rb) goto c, and so on up to OP_JNE
+   OP_JGT,
+   OP_JLE,
+   OP_JGE,
+   OP_JEQ,
+   OP_JNE,
+   OP_JLTK,       /// if (ra < b) goto c, b an immediate, up to OP_JNEK
+   OP_JGTK,
+   OP_JLEK,
+   OP_JGEK,
+   OP_JEQK,
+   OP_JNEK,
+   OP_CALL,       /// ra = functions[b](rc, rc+1, ...), the callee's frame
+                  /// starts at rc and every register from rc up is dead
+   OP_RET,        /// return ra
+   OP_RETVOID,
+   OP_GET,        /// ra = GET()
+   OP_PRINT,      /// PRINT(ra)
+   OP_MALLOC,     /// ra = MALLOC(rb)
+   OP_FREE,       /// FREE(ra)
+   OP_VEC32,      /// for (; ra < rb; ++ra) ((int *) rb+1)[ra] = x op y with x
+                  /// and y from rb+2 and rb+3, c holds op and which of
+                  /// them are arrays, see Vector.h
+   OP_COUNT
+};
+
+inline const char * opcodeName(Opcode op) {
+   static const char * names[OP_COUNT] = {
+      "nop", "loadk", "mov", "loadglobal", "storeglobal", "frameaddr", "zero",
+      "load8", "load32", "load64", "store8", "store32", "store64",
+      "sext8", "sext32", "neg", "not", "lnot", "add", "sub", "mul",
+      "div", "rem", "shl", "shr", "and", "or", "xor", "lt", "gt", "le", "ge",
+      "eq", "ne", "jmp", "jz", "jnz", "addk", "mulk",
+      "jlt", "jgt", "jle", "jge", "jeq", "jne",
+      "jltk", "jgtk", "jlek", "jgek", "jeqk", "jnek", "call", "ret", "retvoid", "get", "print",
+      "malloc", "free", "vec32"
+   };
+   return op < OP_COUNT ? names[op] : "???";
+}
+
+struct Instr {
+   Opcode op;
+   int32_t a, b, c;
+
+   Instr(Opcode op, int32_t a = 0, int32_t b = 0, int32_t c = 0)
+      : op(op), a(a), b(b), c(c) {}
+};
+
+/// A lowered function.  Its frame has numRegs registers, the first
+/// numSlots are variables and the first numParams of those the arguments.
+/// Arrays and variables whose address is taken live in a data frame of
+/// frameBytes bytes on the stack of the interpreter's Memory.  A function
+/// without code is a stub that is only lowered when it is first called;
+/// until then it has just its name and numParams.  lines holds the source
+/// line of every instruction, for the profiler; it is empty if they are
+/// not known.
+struct Function {
+   std::string name;
+   unsigned numParams;
+   unsigned numSlots;
+   unsigned numRegs;
+   LL frameBytes;
+   unsigned line;            /// of the definition, 0 if not known
+   std::vector<Instr> code;
+   std::vector<LL> consts;
+   std::vector<unsigned> lines;
+
+   Function() : name(), numParams(0), numSlots(0), numRegs(0), frameBytes(0), line(0),
+                code(), consts(), lines() {}
+};
+
+/// Lowers the stubs of a Program
+class FunctionLoader {
+public:
+   virtual ~FunctionLoader() {}
+
+   /// Fill in the stub functions[index] of the loader's Program
+   virtual void load(int index) = 0;
+};
+
+/// The whole translation unit after lowering.  Scalar globals take
+/// numGlobals slots of the global area and the other globals dataBytes
+/// bytes of global data.  globalInit is a synthetic function that
+/// initializes the globals before main runs.  If some functions are
+/// still stubs, loader lowers them.
+struct Program {
+   std::vector<Function> functions;
+   unsigned numGlobals;
+   LL dataBytes;
+   int entry;
+   int globalInit;
+   FunctionLoader * loader;
+
+   Program() : functions(), numGlobals(0), dataBytes(0), entry(-1), globalInit(-1),
+               loader(NULL) {}
+
+   /// functions[index], lowering it first if it is a stub.  Lowering only
+   /// fills in that Function, so references to the others stay valid.
+   const Function & function(int index) const {
+      if (functions[index].code.empty()) loader->load(index);
+      return functions[index];
+   }
+
+   void dump(llvm::raw_ostream & os) const {
+      for (const Function & fn : functions) {
+         os << fn.name << " (params " << fn.numParams << ", slots "
+            << fn.numSlots << ", regs " << fn.numRegs << ", frame "
+            << fn.frameBytes << ")" << (fn.code.empty() ? " not lowered" : "") << "\n";
+         for (size_t pc = 0; pc < fn.code.size(); ++pc) {
+            const Instr & I = fn.code[pc];
+            os << "  " << pc << ": " << opcodeName(I.op)
+               << " " << I.a << " " << I.b << " " << I.c;
+            if (I.op == OP_LOADK) os << "\t; " << fn.consts[I.b];
+            os << "\n";
+         }
+      }
+   }
+};
+
+#endif
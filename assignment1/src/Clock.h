@@ -0,0 +1,47 @@
+//==--- Clock.h - Cheap timestamps for the profiler and tracer -------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_CLOCK_H
+#define AST_INTERPRETER_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// Timestamps taken on every call have to cost a few cycles, so they are
+/// time stamp counter ticks where there is one.  A Clock converts them to
+/// ns with the ratio of the ticks and the monotonic clock since it was
+/// created, which is exact enough once it has run for a while.
+class Clock {
+   uint64_t mStartNs;
+   uint64_t mStartTicks;
+public:
+   static uint64_t nanoseconds() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+   }
+
+   static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return nanoseconds();
+#endif
+   }
+
+   Clock() : mStartNs(nanoseconds()), mStartTicks(ticks()) {}
+
+   double nsPerTick() const {
+      uint64_t elapsed = ticks() - mStartTicks;
+      return elapsed ? double(nanoseconds() - mStartNs) / elapsed : 1.0;
+   }
+
+   /// Ticks since the Clock was created
+   uint64_t since(uint64_t ticks) const {
+      return ticks - mStartTicks;
+   }
+};
+
+#endif
@@ -0,0 +1,169 @@
+//==--- CompiledProgram.h - A program compiled once and run many times -----===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_COMPILED_PROGRAM_H
+#define AST_INTERPRETER_COMPILED_PROGRAM_H
+
+#include <memory>
+#include <string>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Compiler.h"
+#include "Optimizer.h"
+#include "ProgramCache.h"
+#include "VM.h"
+
+/// A C program parsed by Clang and lowered to bytecode.  Only main and the
+/// global initializers are lowered up front; the CompiledProgram keeps the
+/// AST and is the Program's FunctionLoader, lowering and optimizing every
+/// other function on its first call.  The Program does not refer to the
+/// AST otherwise, and every run gets a VM of its own with fresh globals
+/// and memory and its own GET and PRINT streams, so one CompiledProgram
+/// can run any number of times.
+///
+/// With a ProgramCache a source compiled before is read back from disk
+/// and Clang is not run at all.  A program that was not in the cache is
+/// completed and added to it after its first run, so the lowering that
+/// run skipped does not delay it.  A function that cannot be lowered is
+/// only a fatal error when it is called: completing such a program leaves
+/// it a stub, and the program is then not cached.
+///
+/// Lowering on demand changes the Program, so run() is for one thread.
+/// Once the program is complete it is immutable and execute() may run it
+/// on any number of threads at once, each execution a VM of its own.
+class CompiledProgram : public FunctionLoader {
+   Program mProgram;
+   std::unique_ptr<clang::ASTUnit> mAST;
+   std::unique_ptr<BytecodeCompiler> mCompiler;
+   std::unique_ptr<Optimizer> mOptimizer;
+   OptimizerStats mStats;
+   bool mOptimized;
+   const ProgramCache * mCache;     /// where to add the program, if anywhere
+   std::string mSource;
+
+   CompiledProgram() : mProgram(), mAST(), mCompiler(), mOptimizer(), mStats(),
+                       mOptimized(false), mCache(NULL), mSource() {}
+
+   /// Lower and optimize the stub functions[index], false with the reason
+   /// in \p error if it cannot be lowered
+   bool lower(int index, std::string & error) {
+      if (!mCompiler->lower(index)) {
+         error = "cannot lower " + mProgram.functions[index].name + ": " + mCompiler->error();
+         return false;
+      }
+      if (mOptimizer) mStats = mOptimizer->optimize(mProgram.functions[index]);
+      return true;
+   }
+public:
+   CompiledProgram(const CompiledProgram &) = delete;
+   CompiledProgram & operator=(const CompiledProgram &) = delete;
+
+   /// Parse \p source and lower main, NULL if Clang reports errors or main
+   /// or the globals cannot be lowered, which \p error then says why.  A
+   /// program found in \p cache is used as is.
+   static std::unique_ptr<CompiledProgram> compile(const std::string & source,
+                                                   bool optimize = true,
+                                                   const ProgramCache * cache = NULL,
+                                                   std::string * error = NULL) {
+      std::unique_ptr<CompiledProgram> compiled(new CompiledProgram());
+      if (cache && cache->load(source, optimize, compiled->mProgram)) return compiled;
+      compiled->mAST = clang::tooling::buildASTFromCode(source);
+      if (!compiled->mAST || compiled->mAST->getDiagnostics().hasErrorOccurred())
+         return nullptr;
+      clang::ASTContext & context = compiled->mAST->getASTContext();
+      compiled->mCompiler.reset(new BytecodeCompiler(context, compiled->mProgram));
+      if (!compiled->mCompiler->compile(context.getTranslationUnitDecl())) {
+         if (error) *error = compiled->mCompiler->error();
+         return nullptr;
+      }
+      compiled->mProgram.loader = compiled.get();
+      compiled->mOptimized = optimize;
+      if (optimize) {
+         compiled->mOptimizer.reset(new Optimizer(compiled->mProgram));
+         compiled->mStats = compiled->mOptimizer->run();
+      }
+      if (cache) {
+         compiled->mCache = cache;
+         compiled->mSource = source;
+      }
+      return compiled;
+   }
+
+   /// Lower the stub functions[index] when it is called, a call of a
+   /// function that cannot be lowered is a fatal error
+   virtual void load(int index) {
+      std::string error;
+      if (!lower(index, error)) llvm::report_fatal_error(error);
+   }
+
+   /// Lower every function still a stub and let go of the AST, then add
+   /// the program to the cache if it is not there yet.  False if some
+   /// function cannot be lowered, with the first one in \p error; the
+   /// program then keeps its stubs and the AST to lower the others on
+   /// demand, and is not cached.
+   bool complete(std::string * error = NULL) {
+      if (mCompiler) {
+         bool lowered = true;
+         for (size_t i = 0; i < mProgram.functions.size(); ++i) {
+            std::string reason;
+            if (mProgram.functions[i].code.empty() && !lower(i, reason) && lowered) {
+               if (error) *error = reason;
+               lowered = false;
+            }
+         }
+         if (!lowered) {
+            mCache = NULL;
+            mSource.clear();
+            return false;
+         }
+         mProgram.loader = NULL;
+         mOptimizer.reset();
+         mCompiler.reset();
+         mAST.reset();
+      }
+      if (mCache) {
+         mCache->store(mSource, mOptimized, mProgram);
+         mCache = NULL;
+         mSource.clear();
+      }
+      return true;
+   }
+
+   bool isComplete() const {
+      return !mProgram.loader && !mCache;
+   }
+
+   /// The lowered program, whose stubs are lowered on their first call
+   const Program & program() const {
+      return mProgram;
+   }
+
+   /// What the optimizer did to the functions lowered so far, all zero if
+   /// the program was not optimized or came from the cache
+   const OptimizerStats & optimizerStats() const {
+      return mStats;
+   }
+
+   /// Run main once, GET reading \p in and PRINT writing \p out
+   void run(Input & in, llvm::raw_ostream & out, const VMOptions & options = VMOptions()) {
+      {
+         VM vm(mProgram, options, in, out);
+         vm.run();
+      }
+      if (mCache) complete();
+   }
+
+   /// Run main once like run(), on a complete program, which this leaves
+   /// untouched
+   void execute(Input & in, llvm::raw_ostream & out,
+                const VMOptions & options = VMOptions()) const {
+      assert(isComplete() && "only a complete program can be shared");
+      VM vm(mProgram, options, in, out);
+      vm.run();
+   }
+};
+
+#endif
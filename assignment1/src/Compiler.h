@@ -0,0 +1,977 @@
+//==--- Compiler.h - Lowers the Clang AST to interpreter bytecode ----------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_COMPILER_H
+#define AST_INTERPRETER_COMPILER_H
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Twine.h"
+
+#include "Bytecode.h"
+#include "Memory.h"
+#include "Vector.h"
+
+using namespace clang;
+
+/// Walks FunctionDecl bodies and emits their bytecode, so the VM never has
+/// to look at the AST again.  compile() lowers only main and the global
+/// initializers and leaves every other function a stub, which lower()
+/// fills in when it is first called, so the work done before the first
+/// instruction runs does not grow with the size of the translation unit.
+/// The compiler and the AST have to outlive the stubs.
+///
+/// A construct the VM has no bytecode for is not fatal: the function
+/// being lowered is finished with the error noted, and compile() or
+/// lower() return false with the first one in error().  A function that
+/// cannot be lowered stays a stub.
+class BytecodeCompiler {
+   /// Storage the resolution pass assigned to a variable.  Scalars live in
+   /// registers or the global area; arrays and variables whose address is
+   /// taken live in memory, in the function's data frame or at a fixed
+   /// address of the global data.
+   struct VarSlot {
+      enum Kind { Local, Global, Frame, Static } kind;
+      LL index;      /// register, global slot, frame offset or address
+   };
+
+   /// Resolution pass run before a body is lowered: gives every variable
+   /// declared in it the next free slot of the function's frame
+   class SlotResolver : public RecursiveASTVisitor<SlotResolver> {
+      BytecodeCompiler & mCompiler;
+   public:
+      explicit SlotResolver(BytecodeCompiler & compiler) : mCompiler(compiler) {}
+
+      bool VisitVarDecl(VarDecl * vardecl) {
+         mCompiler.resolve(vardecl, false);
+         return true;
+      }
+   };
+
+   /// Finds the variables that have to be addressable
+   class AddressTakenFinder : public RecursiveASTVisitor<AddressTakenFinder> {
+      llvm::DenseSet<const VarDecl *> & mTaken;
+   public:
+      explicit AddressTakenFinder(llvm::DenseSet<const VarDecl *> & taken) : mTaken(taken) {}
+
+      bool VisitUnaryOperator(UnaryOperator * uop) {
+         if (uop->getOpcode() != UO_AddrOf) return true;
+         if (DeclRefExpr * declref = dyn_cast<DeclRefExpr>(uop->getSubExpr()->IgnoreParens()))
+            if (VarDecl * vardecl = dyn_cast<VarDecl>(declref->getDecl()))
+               mTaken.insert(vardecl);
+         return true;
+      }
+   };
+
+   /// Where a value lives when it is assigned to
+   struct LValue {
+      enum Kind { Local, Global, Mem } kind;
+      int index;     /// slot for Local and Global
+      int reg;       /// address register for Mem
+      LL size;       /// access width in bytes for Mem
+   };
+
+   /// Pending jumps of the innermost loop
+   struct Loop {
+      std::vector<int> breaks;
+      std::vector<int> continues;
+   };
+
+   const ASTContext & mCtx;
+   Program & mProg;
+
+   FunctionDecl * mFree;				/// Declartions to the built-in functions
+   FunctionDecl * mMalloc;
+   FunctionDecl * mInput;
+   FunctionDecl * mOutput;
+
+   llvm::DenseMap<const FunctionDecl *, int> mFuncIds;
+   std::vector<FunctionDecl *> mBodies;       /// by function index
+   llvm::DenseMap<const VarDecl *, VarSlot> mSlots;
+   llvm::DenseSet<const VarDecl *> mAddressTaken;
+
+   /// The function being lowered
+   Function * mFn;
+   int mNextReg;              /// next free temporary, above the variable slots
+   int mLabel;                /// last instruction index a jump was patched to
+   unsigned mLine;            /// source line of the statement being lowered
+   std::vector<Loop> mLoops;
+   std::string mError;        /// why the function cannot be lowered, if it cannot
+public:
+   BytecodeCompiler(const ASTContext & context, Program & prog)
+      : mCtx(context), mProg(prog), mFree(NULL), mMalloc(NULL), mInput(NULL),
+        mOutput(NULL), mFuncIds(), mBodies(), mSlots(), mAddressTaken(), mFn(NULL), mNextReg(0), mLabel(-1), mLine(0), mLoops(), mError() {
+   }
+
+   /// Lower main and the global initializers of \p unit, false if they
+   /// cannot be lowered
+   bool compile(TranslationUnitDecl * unit) {
+      std::vector<VarDecl *> globals;
+      for (Decl * decl : unit->decls()) {
+         if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(decl)) {
+            if (fdecl->getName().equals("FREE")) mFree = fdecl->getCanonicalDecl();
+            else if (fdecl->getName().equals("MALLOC")) mMalloc = fdecl->getCanonicalDecl();
+            else if (fdecl->getName().equals("GET")) mInput = fdecl->getCanonicalDecl();
+            else if (fdecl->getName().equals("PRINT")) mOutput = fdecl->getCanonicalDecl();
+            else if (fdecl->doesThisDeclarationHaveABody()) {
+               mFuncIds[fdecl->getCanonicalDecl()] = mBodies.size();
+               mBodies.push_back(fdecl);
+               if (fdecl->getName().equals("main")) mProg.entry = mBodies.size() - 1;
+            }
+         } else if (VarDecl * vdecl = dyn_cast<VarDecl>(decl)) {
+            globals.push_back(vdecl);
+         }
+      }
+      if (mProg.entry < 0) {
+         mError = "no main function";
+         return false;
+      }
+      AddressTakenFinder(mAddressTaken).TraverseDecl(unit);
+      for (VarDecl * vdecl : globals)
+         resolve(vdecl, true);
+
+      mProg.functions.resize(mBodies.size() + 1);
+      for (size_t i = 0; i < mBodies.size(); ++i) {
+         mProg.functions[i].name = mBodies[i]->getName().str();
+         mProg.functions[i].numParams = mBodies[i]->getNumParams();
+      }
+      if (!lower(mProg.entry)) return false;
+
+      mProg.globalInit = mBodies.size();
+      begin(mProg.functions[mProg.globalInit], "<globals>");
+      for (VarDecl * vdecl : globals) {
+         mLine = line(vdecl->getBeginLoc());
+         declare(vdecl);
+      }
+      emit(OP_RETVOID);
+      end();
+      return mError.empty();
+   }
+
+   /// Lower the stub functions[index], false if it cannot be lowered.  It
+   /// is a stub again then.
+   bool lower(int index) {
+      Function & fn = mProg.functions[index];
+      assert(fn.code.empty() && "function is lowered already");
+      Function stub = fn;
+      lowerFunction(mBodies[index], fn);
+      if (mError.empty()) return true;
+      fn = stub;
+      return false;
+   }
+
+   /// Why compile() or the last lower() failed
+   const std::string & error() const {
+      return mError;
+   }
+
+private:
+   void begin(Function & fn, StringRef name) {
+      mFn = &fn;
+      mFn->name = name.str();
+      mNextReg = 0;
+      mLabel = -1;
+      mLine = 0;
+      mError.clear();
+   }
+
+   void end() {
+      mFn = NULL;
+   }
+
+   void lowerFunction(FunctionDecl * fdecl, Function & fn) {
+      begin(fn, fdecl->getName());
+      fn.line = line(fdecl->getBeginLoc());
+      mLine = fn.line;
+      /// Arguments arrive in the first registers, the ones whose address is
+      /// taken are copied to their home in the data frame on entry
+      fn.numParams = fdecl->getNumParams();
+      fn.numSlots = fn.numParams;
+      for (unsigned i = 0; i < fdecl->getNumParams(); ++i) {
+         ParmVarDecl * param = fdecl->getParamDecl(i);
+         if (inMemory(param)) resolve(param, false);
+         else mSlots[param] = VarSlot { VarSlot::Local, i };
+      }
+      SlotResolver(*this).TraverseStmt(fdecl->getBody());
+      fn.numRegs = fn.numSlots;
+      fn.frameBytes = alignTo(fn.frameBytes, Memory::kAlign);
+      releaseTemps();
+      for (unsigned i = 0; i < fdecl->getNumParams(); ++i) {
+         ParmVarDecl * param = fdecl->getParamDecl(i);
+         if (inMemory(param)) store(variable(param), i);
+      }
+      stmt(fdecl->getBody());
+      mLine = line(fdecl->getBody()->getEndLoc());
+      emit(OP_RETVOID);
+      end();
+   }
+
+   /// Note that the function cannot be lowered, unless an earlier error
+   /// did.  Lowering goes on, so this returns a register for the value the
+   /// construct would have had.
+   int fail(const llvm::Twine & reason) {
+      if (mError.empty()) mError = reason.str();
+      return newReg();
+   }
+
+   int unsupported(Stmt * stmt) {
+      return fail(llvm::Twine("unsupported construct: ") + stmt->getStmtClassName());
+   }
+
+   /// What lvalue() gives for an expression it cannot lower
+   LValue unsupportedLValue(Expr * e) {
+      LValue lv = { LValue::Mem, 0, unsupported(e), sizeof(LL) };
+      return lv;
+   }
+
+   int emit(Opcode op, int a = 0, int b = 0, int c = 0) {
+      mFn->code.push_back(Instr(op, a, b, c));
+      mFn->lines.push_back(mLine);
+      return mFn->code.size() - 1;
+   }
+
+   unsigned line(SourceLocation loc) {
+      return mCtx.getSourceManager().getExpansionLineNumber(loc);
+   }
+
+   int here() {
+      return mFn->code.size();
+   }
+
+   /// Point the jump at index \p at to \p target
+   void patch(int at, int target) {
+      Instr & I = mFn->code[at];
+      if (I.op == OP_JMP) I.a = target;
+      else I.b = target;
+      if (target > mLabel) mLabel = target;
+   }
+
+   void patchAll(const std::vector<int> & jumps, int target) {
+      for (int at : jumps) patch(at, target);
+   }
+
+   /// The frame of a call is [variable slots | temporaries].  Temporaries
+   /// are handed out stack-wise and all die at the end of the statement
+   /// that computed them, so the frame stays a few registers above the
+   /// slot count.
+   int newReg() {
+      int reg = mNextReg++;
+      if ((unsigned) mNextReg > mFn->numRegs) mFn->numRegs = mNextReg;
+      return reg;
+   }
+
+   void releaseTemps() {
+      mNextReg = mFn->numSlots;
+   }
+
+   bool isTemp(int reg) {
+      return reg >= (int) mFn->numSlots;
+   }
+
+   int constant(LL val) {
+      int reg = newReg();
+      mFn->consts.push_back(val);
+      emit(OP_LOADK, reg, mFn->consts.size() - 1);
+      return reg;
+   }
+
+   static LL alignTo(LL val, LL align) {
+      return (val + align - 1) / align * align;
+   }
+
+   bool inMemory(const VarDecl * vardecl) {
+      return vardecl->getType()->isArrayType() || mAddressTaken.count(vardecl);
+   }
+
+   void resolve(const VarDecl * vardecl, bool global) {
+      VarSlot slot;
+      if (inMemory(vardecl)) {
+         LL & top = global ? mProg.dataBytes : mFn->frameBytes;
+         top = alignTo(top, sizeof(LL));
+         slot.kind = global ? VarSlot::Static : VarSlot::Frame;
+         slot.index = global ? Memory::kDataBase + top : top;
+         top += typeSize(vardecl->getType());
+      } else if (global) {
+         slot.kind = VarSlot::Global;
+         slot.index = mProg.numGlobals++;
+      } else {
+         slot.kind = VarSlot::Local;
+         slot.index = mFn->numSlots++;
+      }
+      mSlots[vardecl] = slot;
+   }
+
+   const VarSlot & slotOf(const VarDecl * vardecl) {
+      llvm::DenseMap<const VarDecl *, VarSlot>::iterator it = mSlots.find(vardecl);
+      assert(it != mSlots.end() && "variable was not resolved");
+      return it->second;
+   }
+
+   int funcId(const FunctionDecl * fdecl) {
+      llvm::DenseMap<const FunctionDecl *, int>::iterator it =
+         mFuncIds.find(fdecl->getCanonicalDecl());
+      if (it == mFuncIds.end()) {
+         fail(llvm::Twine("call to undefined function ") + fdecl->getName());
+         return 0;
+      }
+      return it->second;
+   }
+
+   LL typeSize(QualType type) {
+      if (type->isVoidType()) return 1;
+      return mCtx.getTypeSizeInChars(type).getQuantity();
+   }
+
+   /// Statements
+
+   void stmt(Stmt * s) {
+      if (!s) return;
+      releaseTemps();
+      /// What a loop emits after its body belongs to the loop again
+      unsigned outer = mLine;
+      mLine = line(s->getBeginLoc());
+      if (CompoundStmt * body = dyn_cast<CompoundStmt>(s)) {
+         for (Stmt * child : body->body())
+            stmt(child);
+      } else if (DeclStmt * declstmt = dyn_cast<DeclStmt>(s)) {
+         for (Decl * decl : declstmt->decls())
+            if (VarDecl * vardecl = dyn_cast<VarDecl>(decl))
+               declare(vardecl);
+      } else if (IfStmt * ifstmt = dyn_cast<IfStmt>(s)) {
+         ifStmt(ifstmt);
+      } else if (WhileStmt * wstmt = dyn_cast<WhileStmt>(s)) {
+         whileStmt(wstmt);
+      } else if (DoStmt * dstmt = dyn_cast<DoStmt>(s)) {
+         doStmt(dstmt);
+      } else if (ForStmt * forstmt = dyn_cast<ForStmt>(s)) {
+         forStmt(forstmt);
+      } else if (ReturnStmt * retstmt = dyn_cast<ReturnStmt>(s)) {
+         if (Expr * val = retstmt->getRetValue()) emit(OP_RET, expr(val));
+         else emit(OP_RETVOID);
+      } else if (isa<BreakStmt>(s)) {
+         if (mLoops.empty()) unsupported(s);
+         else mLoops.back().breaks.push_back(emit(OP_JMP));
+      } else if (isa<ContinueStmt>(s)) {
+         if (mLoops.empty()) unsupported(s);
+         else mLoops.back().continues.push_back(emit(OP_JMP));
+      } else if (isa<NullStmt>(s)) {
+      } else if (Expr * e = dyn_cast<Expr>(s)) {
+         expr(e);
+      } else unsupported(s);
+      mLine = outer;
+   }
+
+   void declare(VarDecl * vardecl) {
+      Expr * init = vardecl->getInit();
+      if (init && isa<InitListExpr>(init)) {
+         unsupported(init);
+         return;
+      }
+      /// Data frames are reused between calls, so locals in memory are
+      /// zeroed when declared like the rest of the variables.  Global
+      /// data starts out zero.
+      if (slotOf(vardecl).kind == VarSlot::Frame && !init) {
+         LValue lv = variable(vardecl);
+         emit(OP_ZERO, lv.reg, typeSize(vardecl->getType()));
+      }
+      if (init) store(variable(vardecl), expr(init));
+   }
+
+   void ifStmt(IfStmt * ifstmt) {
+      std::vector<int> skipThen;
+      branch(ifstmt->getCond(), false, skipThen);
+      stmt(ifstmt->getThen());
+      if (Stmt * els = ifstmt->getElse()) {
+         int skipElse = emit(OP_JMP);
+         patchAll(skipThen, here());
+         stmt(els);
+         patch(skipElse, here());
+      } else patchAll(skipThen, here());
+   }
+
+   void beginLoop() {
+      mLoops.push_back(Loop());
+   }
+
+   void endLoop(int continueTarget, int breakTarget) {
+      for (int at : mLoops.back().continues) patch(at, continueTarget);
+      for (int at : mLoops.back().breaks) patch(at, breakTarget);
+      mLoops.pop_back();
+   }
+
+   /// Loops are rotated: the condition sits below the body and jumps back
+   /// to its top, so an iteration runs one branch and no separate jump.
+   /// The loop is entered by jumping to the condition.
+   void loopBack(Expr * cond, int top) {
+      releaseTemps();
+      std::vector<int> back;
+      branch(cond, true, back);
+      patchAll(back, top);
+   }
+
+   void whileStmt(WhileStmt * wstmt) {
+      int entry = emit(OP_JMP);
+      int top = here();
+      beginLoop();
+      stmt(wstmt->getBody());
+      int test = here();
+      patch(entry, test);
+      loopBack(wstmt->getCond(), top);
+      endLoop(test, here());
+   }
+
+   void doStmt(DoStmt * dstmt) {
+      int top = here();
+      beginLoop();
+      stmt(dstmt->getBody());
+      int cont = here();
+      loopBack(dstmt->getCond(), top);
+      endLoop(cont, here());
+   }
+
+   void forStmt(ForStmt * forstmt) {
+      stmt(forstmt->getInit());
+      if (vectorLoop(forstmt)) return;
+      Expr * cond = forstmt->getCond();
+      int entry = cond ? emit(OP_JMP) : -1;
+      int top = here();
+      beginLoop();
+      stmt(forstmt->getBody());
+      int cont = here();
+      releaseTemps();
+      if (Expr * inc = forstmt->getInc()) expr(inc);
+      if (cond) {
+         patch(entry, here());
+         loopBack(cond, top);
+      } else emit(OP_JMP, top);
+      endLoop(cont, here());
+   }
+
+   /// An element-wise loop over int arrays,
+   ///
+   ///    for (...; i < n; i++) a[i] = x op y;
+   ///
+   /// with i a variable in a register, n a value the loop does not change,
+   /// x and y elements b[i] or such values and op one of + - * & | ^, or
+   /// a[i] = x, also as a compound assignment, is one OP_VEC32 that runs
+   /// the whole loop with SIMD instructions.  Any other loop emits nothing
+   /// here and returns false.
+   bool vectorLoop(ForStmt * forstmt) {
+      Expr * cond = forstmt->getCond();
+      BinaryOperator * test = cond ? dyn_cast<BinaryOperator>(cond->IgnoreParenImpCasts()) : NULL;
+      if (!test || test->getOpcode() != BO_LT) return false;
+      const VarDecl * var = registerVar(test->getLHS());
+      if (!var || !invariant(test->getRHS(), var) || !increments(forstmt->getInc(), var))
+         return false;
+      Stmt * body = forstmt->getBody();
+      if (CompoundStmt * block = dyn_cast<CompoundStmt>(body)) {
+         if (block->size() != 1) return false;
+         body = block->body_front();
+      }
+      Expr * e = dyn_cast<Expr>(body);
+      BinaryOperator * assign = e ? dyn_cast<BinaryOperator>(e->IgnoreParens()) : NULL;
+      if (!assign || !assign->isAssignmentOp()) return false;
+      ArraySubscriptExpr * dst = element(assign->getLHS(), var);
+      if (!dst) return false;
+      Opcode op = OP_MOV;
+      Expr * x = assign->getRHS();
+      Expr * y = NULL;
+      if (assign->isCompoundAssignmentOp()) {
+         op = arithOpcode(assign->getOpcode());
+         y = x;
+         x = assign->getLHS();
+      } else if (BinaryOperator * bop = dyn_cast<BinaryOperator>(x->IgnoreParenImpCasts())) {
+         op = arithOpcode(bop->getOpcode());
+         x = bop->getLHS();
+         y = bop->getRHS();
+      }
+      if (op != OP_MOV && op != OP_ADD && op != OP_SUB && op != OP_MUL && op != OP_AND &&
+          op != OP_OR && op != OP_XOR)
+         return false;
+      ArraySubscriptExpr * xs = element(x, var);
+      ArraySubscriptExpr * ys = y ? element(y, var) : NULL;
+      if ((!xs && !invariant(x, var)) || (y && !ys && !invariant(y, var))) return false;
+      int kind = op | (xs ? Vector::kArrayX : 0) | (ys ? Vector::kArrayY : 0);
+      /// Its operands go to consecutive temporaries, the last one stays
+      /// unset for a[i] = x
+      Expr * operands[] = { test->getRHS(), dst->getBase(), xs ? xs->getBase() : x,
+                            ys ? ys->getBase() : y };
+      int first = mNextReg;
+      for (Expr * operand : operands) {
+         int mark = mNextReg;
+         int reg = operand ? expr(operand) : mark;
+         mNextReg = mark;
+         if (reg != newReg()) emit(OP_MOV, mark, reg);
+      }
+      emit(OP_VEC32, slotOf(var).index, first, kind);
+      return true;
+   }
+
+   /// The integer variable in a register \p e reads, NULL if it is none
+   const VarDecl * registerVar(Expr * e) {
+      DeclRefExpr * declref = dyn_cast<DeclRefExpr>(e->IgnoreParenImpCasts());
+      const VarDecl * vardecl = declref ? dyn_cast<VarDecl>(declref->getDecl()) : NULL;
+      if (!vardecl || !vardecl->getType()->isIntegerType()) return NULL;
+      llvm::DenseMap<const VarDecl *, VarSlot>::iterator it = mSlots.find(vardecl);
+      return it != mSlots.end() && it->second.kind == VarSlot::Local ? vardecl : NULL;
+   }
+
+   /// Whether \p e is an integer a loop over \p var storing only to memory
+   /// leaves as it is: a constant or another variable outside memory
+   bool invariant(Expr * e, const VarDecl * var) {
+      if (!e->getType()->isIntegerType()) return false;
+      Expr::EvalResult folded;
+      if (e->EvaluateAsInt(folded, mCtx)) return true;
+      DeclRefExpr * declref = dyn_cast<DeclRefExpr>(e->IgnoreParenImpCasts());
+      const VarDecl * vardecl = declref ? dyn_cast<VarDecl>(declref->getDecl()) : NULL;
+      if (!vardecl || vardecl == var || !vardecl->getType()->isIntegerType()) return false;
+      llvm::DenseMap<const VarDecl *, VarSlot>::iterator it = mSlots.find(vardecl);
+      return it != mSlots.end() &&
+             (it->second.kind == VarSlot::Local || it->second.kind == VarSlot::Global);
+   }
+
+   /// Whether \p inc is i++, ++i, i += 1 or i = i + 1 of \p var
+   bool increments(Expr * inc, const VarDecl * var) {
+      if (!inc) return false;
+      inc = inc->IgnoreParens();
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(inc))
+         return uop->isIncrementOp() && registerVar(uop->getSubExpr()) == var;
+      BinaryOperator * bop = dyn_cast<BinaryOperator>(inc);
+      if (!bop || registerVar(bop->getLHS()) != var) return false;
+      Expr::EvalResult one;
+      if (bop->getOpcode() == BO_AddAssign)
+         return bop->getRHS()->EvaluateAsInt(one, mCtx) && one.Val.getInt() == 1;
+      BinaryOperator * sum = dyn_cast<BinaryOperator>(bop->getRHS()->IgnoreParenImpCasts());
+      if (bop->getOpcode() != BO_Assign || !sum || sum->getOpcode() != BO_Add) return false;
+      return (registerVar(sum->getLHS()) == var && sum->getRHS()->EvaluateAsInt(one, mCtx) &&
+              one.Val.getInt() == 1) ||
+             (registerVar(sum->getRHS()) == var && sum->getLHS()->EvaluateAsInt(one, mCtx) &&
+              one.Val.getInt() == 1);
+   }
+
+   /// \p e if it is array[var] of a 4-byte integer, array being an array
+   /// variable or a pointer variable outside memory, so its address stays
+   /// the same throughout the loop
+   ArraySubscriptExpr * element(Expr * e, const VarDecl * var) {
+      ArraySubscriptExpr * sub = dyn_cast<ArraySubscriptExpr>(e->IgnoreParenImpCasts());
+      if (!sub || !sub->getType()->isIntegerType() || typeSize(sub->getType()) != 4) return NULL;
+      if (registerVar(sub->getIdx()) != var) return NULL;
+      DeclRefExpr * base = dyn_cast<DeclRefExpr>(sub->getBase()->IgnoreParenImpCasts());
+      const VarDecl * array = base ? dyn_cast<VarDecl>(base->getDecl()) : NULL;
+      if (!array || array == var) return NULL;
+      if (array->getType()->isArrayType()) return sub;
+      llvm::DenseMap<const VarDecl *, VarSlot>::iterator it = mSlots.find(array);
+      if (!array->getType()->isPointerType() || it == mSlots.end()) return NULL;
+      return it->second.kind == VarSlot::Local || it->second.kind == VarSlot::Global ? sub : NULL;
+   }
+
+   /// Conditions
+
+   /// Emit a test of \p cond that jumps when its truth value is \p when and
+   /// falls through otherwise, adding the unpatched jumps to \p jumps.  &&,
+   /// || and ! become control flow and constant conditions plain jumps,
+   /// so no truth value is materialized.
+   void branch(Expr * cond, bool when, std::vector<int> & jumps) {
+      cond = cond->IgnoreParens();
+      Expr::EvalResult folded;
+      if (cond->EvaluateAsInt(folded, mCtx)) {
+         if (folded.Val.getInt().getBoolValue() == when)
+            jumps.push_back(emit(OP_JMP));
+         return;
+      }
+      int mark = mNextReg;
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(cond)) {
+         if (uop->getOpcode() == UO_LNot) {
+            branch(uop->getSubExpr(), !when, jumps);
+            return;
+         }
+      }
+      if (BinaryOperator * bop = dyn_cast<BinaryOperator>(cond)) {
+         BinaryOperatorKind opc = bop->getOpcode();
+         if (opc == BO_LAnd || opc == BO_LOr) {
+            /// a && b jumps on false as soon as a is false, on true only if
+            /// b is true too; || is the mirror image
+            bool decided = opc == BO_LOr;
+            std::vector<int> skip;
+            branch(bop->getLHS(), decided, when == decided ? jumps : skip);
+            mNextReg = mark;
+            branch(bop->getRHS(), when, jumps);
+            patchAll(skip, here());
+            return;
+         }
+      }
+      jumps.push_back(emit(when ? OP_JNZ : OP_JZ, expr(cond)));
+      mNextReg = mark;
+   }
+
+   /// Expressions, each returns the register holding its value
+
+   int expr(Expr * e) {
+      e = e->IgnoreParens();
+      if (IntegerLiteral * IL = dyn_cast<IntegerLiteral>(e))
+         return constant(IL->getValue().getSExtValue());
+      if (CharacterLiteral * CL = dyn_cast<CharacterLiteral>(e))
+         return constant(CL->getValue());
+      if (UnaryExprOrTypeTraitExpr * UE = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+         if (UE->getKind() != UETT_SizeOf) return unsupported(e);
+         return constant(typeSize(UE->getTypeOfArgument()));
+      }
+      if (CastExpr * castexpr = dyn_cast<CastExpr>(e))
+         return cast(castexpr);
+      if (BinaryOperator * bop = dyn_cast<BinaryOperator>(e))
+         return binop(bop);
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(e))
+         return uniop(uop);
+      if (CallExpr * callexpr = dyn_cast<CallExpr>(e))
+         return call(callexpr);
+      if (ConditionalOperator * condop = dyn_cast<ConditionalOperator>(e))
+         return conditional(condop);
+      if (e->isGLValue() && !e->getType()->isFunctionType())
+         return load(lvalue(e));
+      return unsupported(e);
+   }
+
+   int cast(CastExpr * castexpr) {
+      switch (castexpr->getCastKind()) {
+      case CK_LValueToRValue:
+         return load(lvalue(castexpr->getSubExpr()));
+      case CK_ArrayToPointerDecay:
+         return address(castexpr->getSubExpr());
+      case CK_FunctionToPointerDecay:
+         return unsupported(castexpr);
+      case CK_IntegralCast: {
+         /// Values are kept sign extended to 64 bits, narrowing re-extends
+         Expr * sub = castexpr->getSubExpr();
+         int val = expr(sub);
+         LL size = typeSize(castexpr->getType());
+         if (size >= typeSize(sub->getType())) return val;
+         int reg = newReg();
+         if (size == 1) emit(OP_SEXT8, reg, val);
+         else if (size == 4) emit(OP_SEXT32, reg, val);
+         else return unsupported(castexpr);
+         return reg;
+      }
+      default:
+         /// integers and pointers share one representation
+         return expr(castexpr->getSubExpr());
+      }
+   }
+
+   LValue variable(const VarDecl * vardecl) {
+      const VarSlot & slot = slotOf(vardecl);
+      LValue lv = { LValue::Mem, 0, 0, typeSize(vardecl->getType()) };
+      switch (slot.kind) {
+      case VarSlot::Local:
+         lv.kind = LValue::Local;
+         lv.index = slot.index;
+         break;
+      case VarSlot::Global:
+         lv.kind = LValue::Global;
+         lv.index = slot.index;
+         break;
+      case VarSlot::Frame:
+         lv.reg = newReg();
+         emit(OP_FRAMEADDR, lv.reg, slot.index);
+         break;
+      case VarSlot::Static:
+         lv.reg = constant(slot.index);
+         break;
+      }
+      return lv;
+   }
+
+   /// Address of an lvalue, which has to live in memory
+   int address(Expr * e) {
+      LValue lv = lvalue(e);
+      if (lv.kind != LValue::Mem) return unsupported(e);
+      return lv.reg;
+   }
+
+   LValue lvalue(Expr * e) {
+      e = e->IgnoreParens();
+      if (DeclRefExpr * declref = dyn_cast<DeclRefExpr>(e)) {
+         VarDecl * vardecl = dyn_cast<VarDecl>(declref->getDecl());
+         if (!vardecl) return unsupportedLValue(e);
+         return variable(vardecl);
+      }
+      if (ArraySubscriptExpr * arrexpr = dyn_cast<ArraySubscriptExpr>(e)) {
+         int ptr = expr(arrexpr->getBase());
+         int idx = expr(arrexpr->getIdx());
+         LL size = typeSize(arrexpr->getType());
+         LValue lv = { LValue::Mem, 0, pointerArith(OP_ADD, ptr, idx, size), size };
+         return lv;
+      }
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(e)) {
+         if (uop->getOpcode() == UO_Deref) {
+            LValue lv = { LValue::Mem, 0, expr(uop->getSubExpr()),
+                          typeSize(uop->getType()) };
+            return lv;
+         }
+      }
+      return unsupportedLValue(e);
+   }
+
+   int load(const LValue & lv) {
+      if (lv.kind == LValue::Local) return lv.index;
+      int reg = newReg();
+      switch (lv.kind) {
+      case LValue::Global: emit(OP_LOADGLOBAL, reg, lv.index); break;
+      case LValue::Mem: emit(accessOpcode(lv.size, false), reg, lv.reg); break;
+      default: break;
+      }
+      return reg;
+   }
+
+   /// Returns the register holding the stored value afterwards
+   int store(const LValue & lv, int val) {
+      switch (lv.kind) {
+      case LValue::Local:
+         if (val == lv.index) break;
+         /// Let the instruction that computed val write the slot itself,
+         /// unless a jump lands right after it
+         if (isTemp(val) && mLabel != here() && here() > 0 &&
+             writesA(mFn->code.back()) && mFn->code.back().a == val)
+            mFn->code.back().a = lv.index;
+         else emit(OP_MOV, lv.index, val);
+         return lv.index;
+      case LValue::Global: emit(OP_STOREGLOBAL, lv.index, val); break;
+      case LValue::Mem: emit(accessOpcode(lv.size, true), lv.reg, val); break;
+      }
+      return val;
+   }
+
+   Opcode accessOpcode(LL size, bool isStore) {
+      switch (size) {
+      case 1: return isStore ? OP_STORE8 : OP_LOAD8;
+      case 4: return isStore ? OP_STORE32 : OP_LOAD32;
+      case 8: return isStore ? OP_STORE64 : OP_LOAD64;
+      default:
+         fail("unsupported access width " + llvm::Twine(size));
+         return isStore ? OP_STORE64 : OP_LOAD64;
+      }
+   }
+
+   static bool writesA(const Instr & I) {
+      switch (I.op) {
+      case OP_STOREGLOBAL: case OP_ZERO:
+      case OP_STORE8: case OP_STORE32: case OP_STORE64:
+      case OP_JMP: case OP_JZ: case OP_JNZ: case OP_RET: case OP_RETVOID:
+      case OP_PRINT: case OP_FREE: case OP_NOP:
+         return false;
+      default:
+         return true;
+      }
+   }
+
+   /// \p val wrapped to the width of \p type, which a store to memory
+   /// does by itself but a register or global slot does not.  Compound
+   /// assignments and ++ and -- compute in int or wider and have no cast
+   /// back to a narrower variable.
+   int narrow(int val, QualType type) {
+      LL size = typeSize(type);
+      if (size != 1 && size != 4) return val;
+      int reg = newReg();
+      emit(size == 1 ? OP_SEXT8 : OP_SEXT32, reg, val);
+      return reg;
+   }
+
+   /// ptr op idx * scale, the scaling Environment::solveAddr used to do at run time
+   int pointerArith(Opcode op, int ptr, int idx, LL scale) {
+      if (scale != 1) {
+         int scaled = newReg();
+         emit(OP_MUL, scaled, idx, constant(scale));
+         idx = scaled;
+      }
+      int reg = newReg();
+      emit(op, reg, ptr, idx);
+      return reg;
+   }
+
+   static Opcode arithOpcode(BinaryOperatorKind opc) {
+      switch (opc) {
+      case BO_Mul: case BO_MulAssign: return OP_MUL;
+      case BO_Div: case BO_DivAssign: return OP_DIV;
+      case BO_Rem: case BO_RemAssign: return OP_REM;
+      case BO_Add: case BO_AddAssign: return OP_ADD;
+      case BO_Sub: case BO_SubAssign: return OP_SUB;
+      case BO_Shl: case BO_ShlAssign: return OP_SHL;
+      case BO_Shr: case BO_ShrAssign: return OP_SHR;
+      case BO_And: case BO_AndAssign: return OP_AND;
+      case BO_Or: case BO_OrAssign: return OP_OR;
+      case BO_Xor: case BO_XorAssign: return OP_XOR;
+      case BO_LT: return OP_LT;
+      case BO_GT: return OP_GT;
+      case BO_LE: return OP_LE;
+      case BO_GE: return OP_GE;
+      case BO_EQ: return OP_EQ;
+      case BO_NE: return OP_NE;
+      default: return OP_NOP;
+      }
+   }
+
+   /// lhs op rhs with C pointer arithmetic
+   int arith(Opcode op, QualType lType, int lhs, QualType rType, int rhs) {
+      if (op == OP_ADD || op == OP_SUB) {
+         if (lType->isPointerType() && rType->isPointerType()) {
+            int diff = newReg();
+            emit(OP_SUB, diff, lhs, rhs);
+            LL scale = typeSize(lType->getPointeeType());
+            if (scale == 1) return diff;
+            int reg = newReg();
+            emit(OP_DIV, reg, diff, constant(scale));
+            return reg;
+         }
+         if (lType->isPointerType())
+            return pointerArith(op, lhs, rhs, typeSize(lType->getPointeeType()));
+         if (rType->isPointerType())
+            return pointerArith(op, rhs, lhs, typeSize(rType->getPointeeType()));
+      }
+      int reg = newReg();
+      emit(op, reg, lhs, rhs);
+      return reg;
+   }
+
+   int binop(BinaryOperator * bop) {
+      Expr * left = bop->getLHS();
+      Expr * right = bop->getRHS();
+      BinaryOperatorKind opc = bop->getOpcode();
+
+      if (opc == BO_Assign) {
+         int val = expr(right);
+         return store(lvalue(left), val);
+      }
+      if (bop->isCompoundAssignmentOp()) {
+         LValue lv = lvalue(left);
+         int cur = load(lv);
+         int val = arith(arithOpcode(opc), left->getType(), cur,
+                         right->getType(), expr(right));
+         return store(lv, narrow(val, left->getType()));
+      }
+      if (opc == BO_Comma) {
+         expr(left);
+         return expr(right);
+      }
+      if (opc == BO_LAnd || opc == BO_LOr) {
+         /// Short circuit, the result is normalized to 0 or 1
+         int reg = newReg();
+         emit(OP_LNOT, reg, expr(left));
+         emit(OP_LNOT, reg, reg);
+         int skip = emit(opc == BO_LAnd ? OP_JZ : OP_JNZ, reg);
+         emit(OP_LNOT, reg, expr(right));
+         emit(OP_LNOT, reg, reg);
+         patch(skip, here());
+         return reg;
+      }
+      Opcode op = arithOpcode(opc);
+      if (op == OP_NOP) return unsupported(bop);
+      int mark = mNextReg;
+      int lhs = expr(left);
+      int rhs = expr(right);
+      if (!left->getType()->isPointerType() && !right->getType()->isPointerType()) {
+         /// Operands are dead once the result is computed, reuse their temporaries
+         mNextReg = mark;
+      }
+      return arith(op, left->getType(), lhs, right->getType(), rhs);
+   }
+
+   int uniop(UnaryOperator * uop) {
+      Expr * sub = uop->getSubExpr();
+      int reg;
+      switch (uop->getOpcode()) {
+      case UO_Plus:
+         return expr(sub);
+      case UO_Minus:
+         reg = newReg();
+         emit(OP_NEG, reg, expr(sub));
+         return reg;
+      case UO_Not:
+         reg = newReg();
+         emit(OP_NOT, reg, expr(sub));
+         return reg;
+      case UO_LNot:
+         reg = newReg();
+         emit(OP_LNOT, reg, expr(sub));
+         return reg;
+      case UO_Deref:
+         return load(lvalue(uop));
+      case UO_AddrOf:
+         return address(sub);
+      case UO_PreInc:
+      case UO_PreDec:
+      case UO_PostInc:
+      case UO_PostDec: {
+         LValue lv = lvalue(sub);
+         int old = load(lv);
+         if (!uop->isPrefix() && !isTemp(old)) {
+            /// The slot is about to change, keep the old value
+            int copy = newReg();
+            emit(OP_MOV, copy, old);
+            old = copy;
+         }
+         LL step = 1;
+         if (sub->getType()->isPointerType())
+            step = typeSize(sub->getType()->getPointeeType());
+         int k = constant(step);
+         reg = newReg();
+         emit(uop->isIncrementOp() ? OP_ADD : OP_SUB, reg, old, k);
+         int stored = store(lv, narrow(reg, sub->getType()));
+         return uop->isPrefix() ? stored : old;
+      }
+      default:
+         return unsupported(uop);
+      }
+   }
+
+   int conditional(ConditionalOperator * condop) {
+      int reg = newReg();
+      std::vector<int> skipTrue;
+      branch(condop->getCond(), false, skipTrue);
+      emit(OP_MOV, reg, expr(condop->getTrueExpr()));
+      int skipFalse = emit(OP_JMP);
+      patchAll(skipTrue, here());
+      emit(OP_MOV, reg, expr(condop->getFalseExpr()));
+      patch(skipFalse, here());
+      return reg;
+   }
+
+   int call(CallExpr * callexpr) {
+      FunctionDecl * callee = callexpr->getDirectCallee();
+      if (!callee) return unsupported(callexpr);
+      callee = callee->getCanonicalDecl();
+      int reg;
+      if (callee == mInput) {
+         reg = newReg();
+         emit(OP_GET, reg);
+      } else if (callee == mOutput) {
+         reg = expr(callexpr->getArg(0));
+         emit(OP_PRINT, reg);
+      } else if (callee == mMalloc) {
+         reg = newReg();
+         emit(OP_MALLOC, reg, expr(callexpr->getArg(0)));
+      } else if (callee == mFree) {
+         reg = expr(callexpr->getArg(0));
+         emit(OP_FREE, reg);
+      } else {
+         /// Arguments go to consecutive temporaries above every live
+         /// register.  The callee's frame starts at the first of them, so
+         /// they are its parameter slots without further copying.
+         int first = mNextReg;
+         for (unsigned i = 0; i < callexpr->getNumArgs(); ++i) {
+            int mark = mNextReg;
+            int arg = expr(callexpr->getArg(i));
+            mNextReg = mark;
+            if (arg != newReg()) emit(OP_MOV, mark, arg);
+         }
+         mNextReg = first;
+         reg = newReg();
+         emit(OP_CALL, reg, funcId(callee), first);
+      }
+      return reg;
+   }
+};
+
+#endif
@@ -0,0 +1,217 @@
+//==--- ForkServer.h - One run of a program forked for many inputs ---------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_FORK_SERVER_H
+#define AST_INTERPRETER_FORK_SERVER_H
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "IO.h"
+
+/// Runs a program once up to its first GET, then forks the process there
+/// once per input file, so the part before the first GET, often most of
+/// the setup, runs once instead of once per input.  The children share
+/// everything the run built up so far, the program's memory and the
+/// native code compiled for it included, copy on write.
+///
+/// The ForkServer is both the Input and the output of that run.  Output
+/// before the fork is kept and becomes the start of every child's output;
+/// a child then reads its input file and writes to a pipe to the parent.
+/// The parent runs up to \p jobs children at once, collects their output
+/// in input order, prints one line per input to \p report and exits
+/// without returning to the program.  A program that never reads input
+/// just finishes, and report() gives every input its one output.
+///
+/// Since the parent never returns, whatever a run reports at its end, like
+/// a profile or a trace, is reported by the hook given to onSnapshot(),
+/// which the parent calls once right before the first fork.  That covers
+/// the part of the run the inputs share, and the children inherit that it
+/// was reported, so they do not report it once per input.
+class ForkServer : public Input {
+   /// The run's PRINT output: kept in memory until the fork, written to
+   /// the pipe to the parent in a child
+   class Output : public llvm::raw_ostream {
+      std::string mBuffer;
+      int mFd;
+      uint64_t mBytes;
+
+      void write_impl(const char * ptr, size_t size) override {
+         mBytes += size;
+         if (mFd < 0) {
+            mBuffer.append(ptr, size);
+            return;
+         }
+         while (size) {
+            ssize_t done = ::write(mFd, ptr, size);
+            if (done < 0 && errno == EINTR) continue;
+            if (done <= 0) return;
+            ptr += done;
+            size -= done;
+         }
+      }
+
+      uint64_t current_pos() const override {
+         return mBytes;
+      }
+   public:
+      Output() : mBuffer(), mFd(-1), mBytes(0) {
+         SetBufferSize(1 << 16);
+      }
+
+      ~Output() override {
+         flush();
+      }
+
+      /// Everything written so far, once flushed
+      const std::string & buffer() const {
+         return mBuffer;
+      }
+
+      /// Write everything written so far and from now on to \p fd
+      void redirect(int fd) {
+         flush();
+         mFd = fd;
+         write_impl(mBuffer.data(), mBuffer.size());
+         mBytes -= mBuffer.size();
+         mBuffer.clear();
+      }
+   };
+
+   /// A child and its output so far
+   struct Child {
+      size_t input;
+      pid_t pid;
+      int fd;
+   };
+
+   std::vector<std::string> mInputs;
+   std::vector<std::string> mNames;      /// as the report shows them
+   unsigned mJobs;
+   llvm::raw_ostream & mReport;
+   Output mOutput;
+   std::unique_ptr<llvm::MemoryBuffer> mInput;    /// a child's input file
+   bool mForked;
+   bool mRead;
+   std::function<void()> mOnSnapshot;
+
+   /// Fork the child for input \p index, which returns true
+   bool start(size_t index, std::deque<Child> & children) {
+      int fds[2];
+      if (pipe(fds)) llvm::report_fatal_error("fork server cannot create a pipe");
+      mReport.flush();
+      llvm::errs().flush();
+      pid_t pid = ::fork();
+      if (pid < 0) llvm::report_fatal_error("fork server cannot fork");
+      if (!pid) {
+         close(fds[0]);
+         mOutput.redirect(fds[1]);
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> input =
+            llvm::MemoryBuffer::getFile(mInputs[index]);
+         if (!input) {
+            llvm::errs() << mInputs[index] << ": cannot open\n";
+            _exit(1);
+         }
+         mInput = std::move(*input);
+         return true;
+      }
+      close(fds[1]);
+      Child child = { index, pid, fds[0] };
+      children.push_back(child);
+      return false;
+   }
+
+   /// Read the oldest child's output until it exits
+   bool collect(std::deque<Child> & children) {
+      Child child = children.front();
+      children.pop_front();
+      std::string output;
+      char block[4096];
+      for (;;) {
+         ssize_t bytes = ::read(child.fd, block, sizeof(block));
+         if (bytes < 0 && errno == EINTR) continue;
+         if (bytes <= 0) break;
+         output.append(block, bytes);
+      }
+      close(child.fd);
+      int status = 0;
+      while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR) {}
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      mReport << mNames[child.input] << ": " << output;
+      if (!ok) mReport << " (failed)";
+      mReport << "\n";
+      return ok;
+   }
+
+   /// The snapshot: fork a child per input, and in the parent report and
+   /// exit once all are done
+   void snapshot() {
+      mForked = true;
+      if (mOnSnapshot) mOnSnapshot();
+      std::deque<Child> children;
+      int failed = 0;
+      for (size_t i = 0; i < mInputs.size(); ++i) {
+         if (children.size() >= mJobs) failed += !collect(children);
+         if (start(i, children)) return;
+      }
+      while (!children.empty()) failed += !collect(children);
+      mReport.flush();
+      _exit(failed ? 1 : 0);
+   }
+protected:
+   virtual size_t fill(const char *& data) {
+      if (!mForked) {
+         mOutput.flush();
+         snapshot();
+      }
+      /// A child reads its input file whole, once
+      if (mRead) return 0;
+      mRead = true;
+      data = mInput->getBufferStart();
+      return mInput->getBufferSize();
+   }
+public:
+   /// A server for the input files \p inputs, shown in the report as
+   /// \p names, running \p jobs children at a time
+   ForkServer(const std::vector<std::string> & inputs, const std::vector<std::string> & names,
+              unsigned jobs, llvm::raw_ostream & report)
+      : mInputs(inputs), mNames(names), mJobs(jobs ? jobs : 1), mReport(report),
+        mOutput(), mInput(), mForked(false), mRead(false), mOnSnapshot() {
+   }
+
+   /// Call \p hook in the parent right before it forks the first child
+   void onSnapshot(std::function<void()> hook) {
+      mOnSnapshot = std::move(hook);
+   }
+
+   /// The stream the run has to PRINT to
+   llvm::raw_ostream & output() {
+      return mOutput;
+   }
+
+   /// Whether this process is one of the children
+   bool isChild() const {
+      return mForked;
+   }
+
+   /// After a run that never read input, report its output for every input
+   void report() {
+      mOutput.flush();
+      for (const std::string & name : mNames)
+         mReport << name << ": " << mOutput.buffer() << "\n";
+      mReport.flush();
+   }
+};
+
+#endif
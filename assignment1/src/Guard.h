@@ -0,0 +1,111 @@
+//==--- Guard.h - Faults of a guarded Memory as program errors -------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_GUARD_H
+#define AST_INTERPRETER_GUARD_H
+
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "llvm/Support/ErrorHandling.h"
+
+#include "Bytecode.h"
+#include "Memory.h"
+
+/// Catches the accesses of a program to the inaccessible pages of its
+/// guarded Memory, so they cost nothing until one faults.  While a Guard
+/// is armed, a SIGSEGV or SIGBUS at an address in the range of its Memory
+/// jumps back to where it was armed with sigsetjmp on jump(), and
+/// address() tells where the program accessed.  Other faults go to the
+/// handlers that were there before, which then see them again.
+///
+/// The handler finds the Guard by address, not by thread, so Guards armed
+/// by programs that take turns on one thread each catch their own faults.
+/// At most kMaxGuards may be armed at a time.
+class Guard {
+public:
+   static const unsigned kMaxGuards = 1024;
+private:
+   const char * mBase;
+   const char * mLow;
+   const char * mHigh;
+   sigjmp_buf mJump;
+   volatile uintptr_t mFault;
+   int mSlot;                /// where it is armed, -1 if it is not
+
+   static std::atomic<Guard *> * armed() {
+      static std::atomic<Guard *> guards[kMaxGuards];
+      return guards;
+   }
+
+   static struct sigaction * previous() {
+      static struct sigaction actions[2];
+      return actions;
+   }
+
+   /// Runs in the signal handler
+   static void handle(int sig, siginfo_t * info, void *) {
+      const char * addr = (const char *) info->si_addr;
+      for (unsigned i = 0; i < kMaxGuards; ++i) {
+         Guard * guard = armed()[i].load(std::memory_order_acquire);
+         if (guard && addr >= guard->mLow && addr < guard->mHigh) {
+            guard->mFault = (uintptr_t) addr;
+            siglongjmp(guard->mJump, 1);
+         }
+      }
+      sigaction(sig, &previous()[sig == SIGBUS], NULL);
+   }
+public:
+   explicit Guard(Memory & memory)
+      : mBase(memory.base()), mLow(memory.base() - memory.guardBytes()),
+        mHigh(memory.base() + memory.size() + memory.guardBytes()), mJump(), mFault(0),
+        mSlot(-1) {}
+
+   ~Guard() {
+      disarm();
+   }
+
+   Guard(const Guard &) = delete;
+   Guard & operator=(const Guard &) = delete;
+
+   /// Where arm() returns to on a fault, sigsetjmp with a saved mask
+   sigjmp_buf & jump() {
+      return mJump;
+   }
+
+   /// Catch faults, once jump() is set
+   void arm() {
+      static std::once_flag installed;
+      std::call_once(installed, [] {
+         struct sigaction action;
+         memset(&action, 0, sizeof(action));
+         action.sa_sigaction = handle;
+         action.sa_flags = SA_SIGINFO;
+         sigemptyset(&action.sa_mask);
+         sigaction(SIGSEGV, &action, &previous()[0]);
+         sigaction(SIGBUS, &action, &previous()[1]);
+      });
+      for (unsigned i = 0; i < kMaxGuards && mSlot < 0; ++i) {
+         Guard * none = NULL;
+         if (armed()[i].compare_exchange_strong(none, this)) mSlot = i;
+      }
+      if (mSlot < 0) llvm::report_fatal_error("too many guarded programs running");
+   }
+
+   void disarm() {
+      if (mSlot < 0) return;
+      armed()[mSlot].store(NULL, std::memory_order_release);
+      mSlot = -1;
+   }
+
+   /// The interpreter address of the last fault
+   LL address() const {
+      return (LL) (mFault - (uintptr_t) mBase);
+   }
+};
+
+#endif
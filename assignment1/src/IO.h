@@ -0,0 +1,155 @@
+//==--- IO.h - Input read by GET --------------------------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_IO_H
+#define AST_INTERPRETER_IO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "Bytecode.h"
+
+/// The integers GET reads.  An Input parses them straight out of a buffer
+/// that a subclass fills in bulk, so reading a million values takes a few
+/// hundred reads instead of a scanf each.  Like scanf("%lld"), reading
+/// skips white space, yields 0 at the end of the input and leaves
+/// anything that is not a number where it is.
+///
+/// PRINT needs no counterpart: its output is any llvm::raw_ostream, which
+/// buffers by itself.
+class Input {
+   const char * mPos;
+   const char * mEnd;
+   bool mEof;
+
+   /// Make a byte available, false at the end of the input
+   bool more() {
+      if (mPos < mEnd) return true;
+      if (mEof) return false;
+      mPos = mEnd = NULL;
+      size_t bytes = fill(mPos);
+      if (!bytes) {
+         mEof = true;
+         return false;
+      }
+      mEnd = mPos + bytes;
+      return true;
+   }
+protected:
+   /// Point \p data at the next bytes of the input and return how many,
+   /// 0 at its end.  The bytes stay valid until the next call.
+   virtual size_t fill(const char *& data) = 0;
+public:
+   Input() : mPos(NULL), mEnd(NULL), mEof(false) {}
+   virtual ~Input() {}
+
+   Input(const Input &) = delete;
+   Input & operator=(const Input &) = delete;
+
+   /// Whether a prompt for this input would reach a person
+   virtual bool interactive() const {
+      return false;
+   }
+
+   LL readInt() {
+      while (more() && (*mPos == ' ' || (*mPos >= '\t' && *mPos <= '\r'))) ++mPos;
+      if (!more()) return 0;
+      bool negative = *mPos == '-';
+      if (*mPos == '-' || *mPos == '+') {
+         ++mPos;
+         if (!more()) return 0;
+      }
+      unsigned long long val = 0;
+      while (more() && *mPos >= '0' && *mPos <= '9')
+         val = val * 10 + (*mPos++ - '0');
+      return negative ? -(LL) val : (LL) val;
+   }
+
+   /// The process's standard input
+   static Input & standard();
+};
+
+/// Input from a file descriptor.  A regular file is mapped whole, anything
+/// else is read in large blocks.
+class FileInput : public Input {
+   static const size_t kBlockBytes = 1 << 16;
+
+   int mFd;
+   bool mOwned;
+   void * mMap;            /// the whole file if it is mapped
+   size_t mMapBytes;
+   off_t mOffset;          /// where reading starts in it
+   std::unique_ptr<char[]> mBlock;
+protected:
+   virtual size_t fill(const char *& data) {
+      if (mMap) {
+         data = (const char *) mMap + mOffset;
+         size_t bytes = mMapBytes - mOffset;
+         mOffset = mMapBytes;
+         return bytes;
+      }
+      if (!mBlock) mBlock.reset(new char[kBlockBytes]);
+      ssize_t bytes;
+      do bytes = read(mFd, mBlock.get(), kBlockBytes);
+      while (bytes < 0 && errno == EINTR);
+      data = mBlock.get();
+      return bytes > 0 ? bytes : 0;
+   }
+public:
+   /// Read \p fd, closing it when done if \p owned
+   explicit FileInput(int fd, bool owned = false)
+      : mFd(fd), mOwned(owned), mMap(NULL), mMapBytes(0), mOffset(0), mBlock() {
+      struct stat st;
+      if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+      mOffset = lseek(fd, 0, SEEK_CUR);
+      if (mOffset < 0 || mOffset >= st.st_size) return;
+      void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) return;
+      mMap = map;
+      mMapBytes = st.st_size;
+   }
+
+   ~FileInput() {
+      if (mMap) munmap(mMap, mMapBytes);
+      if (mOwned) close(mFd);
+   }
+
+   virtual bool interactive() const {
+      return isatty(mFd);
+   }
+
+   /// Input from the file at \p path, NULL if it cannot be opened
+   static std::unique_ptr<FileInput> open(const std::string & path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) return nullptr;
+      return std::unique_ptr<FileInput>(new FileInput(fd, true));
+   }
+};
+
+/// Input held in memory, which has to outlive the StringInput
+class StringInput : public Input {
+   llvm::StringRef mText;
+protected:
+   virtual size_t fill(const char *& data) {
+      data = mText.data();
+      size_t bytes = mText.size();
+      mText = llvm::StringRef();
+      return bytes;
+   }
+public:
+   explicit StringInput(llvm::StringRef text) : mText(text) {}
+};
+
+inline Input & Input::standard() {
+   static FileInput input(STDIN_FILENO);
+   return input;
+}
+
+#endif
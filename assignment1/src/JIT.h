@@ -0,0 +1,575 @@
+//==--- JIT.h - Native code tier for hot functions --------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_JIT_H
+#define AST_INTERPRETER_JIT_H
+
+#include <stddef.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "Bytecode.h"
+#include "Environment.h"
+#include "Vector.h"
+
+/// The state native code shares with the VM.  Compiled functions take a
+/// pointer to it as their first argument and reach the program's memory,
+/// the globals and the built-ins through it.
+struct JitContext {
+   char * mem;
+   LL * globals;
+   LL * regs;           /// the VM's register stack, which moves as it grows
+   LL nativeDepth;      /// calls of compiled code on the native stack
+   LL depthLimit;       /// nativeDepth at which the call depth is exceeded
+   Environment * env;
+   void * owner;
+   /// Runs a function that has not been compiled, calling back into the VM
+   LL (*call)(void * owner, int fn, const LL * args);
+};
+
+/// Compiles bytecode Functions to native code with ORC.  Every function
+/// becomes "fn<N>", taking the context and its arguments, plus an entry
+/// "fn<N>.entry" taking the context and a pointer to the arguments, which
+/// is how the VM calls it.  Registers become SSA values, calls between
+/// compiled functions are direct and calls to functions still interpreted
+/// go through JitContext::call.  The built-ins are bound to the
+/// Environment's implementations.
+///
+/// For on-stack replacement a loop of a running function is compiled on
+/// its own as "fn<N>.osr<H>", H being the loop header.  It takes the
+/// context, the first register of the interpreter's frame and its data
+/// frame, loads the registers, and runs from the header until control
+/// leaves the loop or reaches a return.  Then it stores the registers
+/// back and returns the index of the instruction the interpreter resumes
+/// at.
+class JIT {
+public:
+   typedef LL (*Entry)(JitContext *, const LL *);
+   typedef LL (*OsrEntry)(JitContext *, LL base, LL fp);
+private:
+   const Program & mProg;
+   std::unique_ptr<llvm::orc::LLJIT> mJIT;
+   std::vector<bool> mCompiled;
+
+   explicit JIT(const Program & prog, std::unique_ptr<llvm::orc::LLJIT> jit)
+      : mProg(prog), mJIT(std::move(jit)), mCompiled(prog.functions.size(), false) {
+   }
+
+   /// The built-ins, called from native code
+   static LL rtGet(JitContext * ctx) {
+      return ctx->env->input();
+   }
+   static void rtPrint(JitContext * ctx, LL val) {
+      ctx->env->output(val);
+   }
+   static LL rtMalloc(JitContext * ctx, LL size) {
+      return ctx->env->allocate(size);
+   }
+   static void rtFree(JitContext * ctx, LL addr) {
+      ctx->env->deallocate(addr);
+   }
+   static void rtZero(JitContext * ctx, LL addr, LL bytes) {
+      ctx->env->memory().zero(addr, bytes);
+   }
+   static LL rtVec32(JitContext * ctx, LL kind, LL i, LL n, LL dst, LL x, LL y) {
+      return Vector::run(ctx->mem, (int) kind, i, n, dst, x, y);
+   }
+   static LL rtPushFrame(JitContext * ctx, LL bytes) {
+      return ctx->env->memory().pushFrame(bytes);
+   }
+   static void rtPopFrame(JitContext * ctx, LL bytes) {
+      ctx->env->memory().popFrame(bytes);
+   }
+   static LL rtCall(JitContext * ctx, LL fn, const LL * args) {
+      return ctx->call(ctx->owner, (int) fn, args);
+   }
+   static void rtDepthExceeded(JitContext * ctx) {
+      llvm::report_fatal_error(llvm::Twine("call depth exceeds the limit in compiled code, ") +
+                               llvm::Twine(ctx->nativeDepth) + " native calls deep");
+   }
+
+   llvm::Error bindRuntime() {
+      llvm::orc::SymbolMap symbols;
+      bind(symbols, "rt.get", (void *) &rtGet);
+      bind(symbols, "rt.print", (void *) &rtPrint);
+      bind(symbols, "rt.malloc", (void *) &rtMalloc);
+      bind(symbols, "rt.free", (void *) &rtFree);
+      bind(symbols, "rt.zero", (void *) &rtZero);
+      bind(symbols, "rt.vec32", (void *) &rtVec32);
+      bind(symbols, "rt.pushframe", (void *) &rtPushFrame);
+      bind(symbols, "rt.popframe", (void *) &rtPopFrame);
+      bind(symbols, "rt.call", (void *) &rtCall);
+      bind(symbols, "rt.depth", (void *) &rtDepthExceeded);
+      return mJIT->getMainJITDylib().define(llvm::orc::absoluteSymbols(symbols));
+   }
+
+   void bind(llvm::orc::SymbolMap & symbols, const char * name, void * addr) {
+      symbols[mJIT->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+         llvm::pointerToJITTargetAddress(addr), llvm::JITSymbolFlags::Exported);
+   }
+
+   /// Register the host target, once per process
+   static bool initializeTarget() {
+      llvm::InitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmPrinter();
+      return true;
+   }
+
+   static std::string bodyName(int fn) {
+      return "fn" + std::to_string(fn);
+   }
+
+   static std::string osrName(int fn, int header) {
+      return bodyName(fn) + ".osr" + std::to_string(header);
+   }
+
+   /// Lowers one Function to IR
+   class Translator {
+      JIT & mJit;
+      const Function & mFn;
+      int mIndex;
+      llvm::Module & mModule;
+      llvm::IRBuilder<> mB;
+      llvm::Type * mI64;
+      llvm::Type * mI8Ptr;
+      llvm::Value * mCtx;
+      llvm::Value * mMem;
+      llvm::Value * mGlobals;
+      llvm::Value * mFp;
+      llvm::Value * mArgs;          /// argument buffer of calls to interpreted code
+      llvm::Value * mBase;          /// first register of the frame, for OSR
+      std::vector<llvm::Value *> mRegs;
+      std::vector<llvm::BasicBlock *> mBlocks;
+      /// The loop compiled for OSR, from its header to its back-edge, and
+      /// the exits from it.  mFirst is -1 when compiling whole functions.
+      int mFirst, mLast;
+      std::map<int, llvm::BasicBlock *> mExits;
+
+   public:
+      /// Function \p index is lowered first if it is still a stub
+      Translator(JIT & jit, int index, llvm::Module & module, int first = -1, int last = -1)
+         : mJit(jit), mFn(jit.mProg.function(index)), mIndex(index), mModule(module),
+           mB(module.getContext()), mI64(mB.getInt64Ty()), mI8Ptr(mB.getInt8PtrTy()),
+           mCtx(NULL), mMem(NULL), mGlobals(NULL), mFp(NULL), mArgs(NULL), mBase(NULL),
+           mRegs(), mBlocks(), mFirst(first), mLast(last), mExits() {
+      }
+
+      void translate() {
+         bool osr = mFirst >= 0;
+         llvm::Function * F = osr ? osrFunction() : body(mIndex);
+         llvm::BasicBlock * entry = llvm::BasicBlock::Create(mB.getContext(), "entry", F);
+         mB.SetInsertPoint(entry);
+         createBlocks(F);
+         if (osr) {
+            osrPrologue(F);
+            block(F, mFirst);
+            mB.CreateBr(mBlocks[mFirst]);
+         } else prologue(F);
+         size_t first = osr ? mFirst : 0;
+         size_t last = osr ? mLast : mFn.code.size() - 1;
+         for (size_t pc = first; pc <= last; ++pc) {
+            if (mBlocks[pc]) {
+               if (!mB.GetInsertBlock()->getTerminator()) mB.CreateBr(mBlocks[pc]);
+               mB.SetInsertPoint(mBlocks[pc]);
+            }
+            instruction(mFn.code[pc]);
+         }
+         if (!mB.GetInsertBlock()->getTerminator()) {
+            if (osr) mB.CreateBr(blockAt(last + 1));
+            else epilogue(mB.getInt64(0));
+         }
+         if (osr) {
+            /// Blocks outside the loop were replaced by exits
+            for (size_t pc = 0; pc < mFn.code.size(); ++pc)
+               if (mBlocks[pc] && (pc < first || pc > last)) mBlocks[pc]->eraseFromParent();
+         } else entryThunk(F);
+      }
+
+   private:
+      /// The compiled body of function \p fn, declared if it is another one
+      llvm::Function * body(int fn) {
+         std::string name = bodyName(fn);
+         if (llvm::Function * F = mModule.getFunction(name)) return F;
+         std::vector<llvm::Type *> params(1 + mJit.mProg.functions[fn].numParams, mI64);
+         params[0] = mI8Ptr;
+         llvm::FunctionType * type = llvm::FunctionType::get(mI64, params, false);
+         return llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, &mModule);
+      }
+
+      llvm::FunctionCallee runtime(const char * name, llvm::Type * ret,
+                                   llvm::ArrayRef<llvm::Type *> params) {
+         return mModule.getOrInsertFunction(name, llvm::FunctionType::get(ret, params, false));
+      }
+
+      llvm::Value * field(size_t offset, llvm::Type * type) {
+         llvm::Value * addr = mB.CreateConstInBoundsGEP1_64(mB.getInt8Ty(), mCtx, offset);
+         return mB.CreateBitCast(addr, type->getPointerTo());
+      }
+
+      /// Registers, the argument buffer, memory and globals
+      void locals() {
+         for (unsigned reg = 0; reg < mFn.numRegs; ++reg)
+            mRegs.push_back(mB.CreateAlloca(mI64));
+         unsigned maxArgs = 0;
+         for (const Instr & I : mFn.code)
+            if (I.op == OP_CALL)
+               maxArgs = std::max(maxArgs, mJit.mProg.functions[I.b].numParams);
+         if (maxArgs)
+            mArgs = mB.CreateAlloca(mI64, mB.getInt32(maxArgs));
+         mMem = mB.CreateLoad(mI8Ptr, field(offsetof(JitContext, mem), mI8Ptr));
+         mGlobals = mB.CreateLoad(mI64->getPointerTo(),
+                                  field(offsetof(JitContext, globals), mI64->getPointerTo()));
+      }
+
+      void prologue(llvm::Function * F) {
+         llvm::Function::arg_iterator arg = F->arg_begin();
+         mCtx = &*arg++;
+         locals();
+         for (unsigned reg = 0; reg < mFn.numSlots; ++reg)
+            mB.CreateStore(reg < mFn.numParams ? (llvm::Value *) &*arg++ : mB.getInt64(0),
+                           mRegs[reg]);
+
+         llvm::Value * depthAddr = field(offsetof(JitContext, nativeDepth), mI64);
+         llvm::Value * depth = mB.CreateAdd(mB.CreateLoad(mI64, depthAddr), mB.getInt64(1));
+         mB.CreateStore(depth, depthAddr);
+         llvm::Value * limit = mB.CreateLoad(mI64, field(offsetof(JitContext, depthLimit), mI64));
+         llvm::BasicBlock * exceeded = llvm::BasicBlock::Create(mB.getContext(), "exceeded", F);
+         llvm::BasicBlock * ok = llvm::BasicBlock::Create(mB.getContext(), "ok", F);
+         mB.CreateCondBr(mB.CreateICmpSGE(depth, limit), exceeded, ok);
+         mB.SetInsertPoint(exceeded);
+         mB.CreateCall(runtime("rt.depth", mB.getVoidTy(), { mI8Ptr }), { mCtx });
+         mB.CreateUnreachable();
+         mB.SetInsertPoint(ok);
+
+         mFp = mFn.frameBytes
+            ? mB.CreateCall(runtime("rt.pushframe", mI64, { mI8Ptr, mI64 }),
+                            { mCtx, mB.getInt64(mFn.frameBytes) })
+            : (llvm::Value *) mB.getInt64(0);
+      }
+
+      void epilogue(llvm::Value * val) {
+         llvm::Value * depthAddr = field(offsetof(JitContext, nativeDepth), mI64);
+         mB.CreateStore(mB.CreateSub(mB.CreateLoad(mI64, depthAddr), mB.getInt64(1)), depthAddr);
+         if (mFn.frameBytes)
+            mB.CreateCall(runtime("rt.popframe", mB.getVoidTy(), { mI8Ptr, mI64 }),
+                          { mCtx, mB.getInt64(mFn.frameBytes) });
+         mB.CreateRet(val);
+      }
+
+      llvm::Function * osrFunction() {
+         llvm::FunctionType * type = llvm::FunctionType::get(mI64, { mI8Ptr, mI64, mI64 }, false);
+         return llvm::Function::Create(type, llvm::Function::ExternalLinkage,
+                                       osrName(mIndex, mFirst), &mModule);
+      }
+
+      /// The interpreter's frame in the register stack
+      llvm::Value * frame() {
+         llvm::Value * regs = mB.CreateLoad(mI64->getPointerTo(),
+                                            field(offsetof(JitContext, regs), mI64->getPointerTo()));
+         return mB.CreateInBoundsGEP(mI64, regs, mBase);
+      }
+
+      /// The interpreter's registers become the SSA values of the loop
+      void osrPrologue(llvm::Function * F) {
+         llvm::Function::arg_iterator arg = F->arg_begin();
+         mCtx = &*arg++;
+         mBase = &*arg++;
+         mFp = &*arg;
+         locals();
+         llvm::Value * regs = frame();
+         for (unsigned reg = 0; reg < mFn.numRegs; ++reg)
+            mB.CreateStore(mB.CreateLoad(mI64, mB.CreateConstInBoundsGEP1_64(mI64, regs, reg)),
+                           mRegs[reg]);
+      }
+
+      /// Block of the instruction \p pc, for OSR code an exit when it is
+      /// outside the loop
+      llvm::BasicBlock * blockAt(int pc) {
+         if (mFirst >= 0 && (pc < mFirst || pc > mLast)) return exit(pc);
+         return mBlocks[pc];
+      }
+
+      /// Leave OSR code, handing the registers back to the interpreter,
+      /// which resumes at \p pc
+      llvm::BasicBlock * exit(int pc) {
+         llvm::BasicBlock *& block = mExits[pc];
+         if (block) return block;
+         llvm::IRBuilderBase::InsertPointGuard guard(mB);
+         block = llvm::BasicBlock::Create(mB.getContext(), "exit", mB.GetInsertBlock()->getParent());
+         mB.SetInsertPoint(block);
+         llvm::Value * regs = frame();
+         for (unsigned reg = 0; reg < mFn.numRegs; ++reg)
+            mB.CreateStore(get(reg), mB.CreateConstInBoundsGEP1_64(mI64, regs, reg));
+         mB.CreateRet(mB.getInt64(pc));
+         return block;
+      }
+
+      /// A block starts at every jump target and after every jump
+      void createBlocks(llvm::Function * F) {
+         mBlocks.assign(mFn.code.size() + 1, NULL);
+         for (size_t pc = 0; pc < mFn.code.size(); ++pc) {
+            const Instr & I = mFn.code[pc];
+            int target = -1;
+            if (I.op == OP_JMP) target = I.a;
+            else if (I.op == OP_JZ || I.op == OP_JNZ) target = I.b;
+            else if (I.op >= OP_JLT && I.op <= OP_JNEK) target = I.c;
+            bool ends = target >= 0 || I.op == OP_RET || I.op == OP_RETVOID;
+            if (target >= 0) block(F, target);
+            if (ends) block(F, pc + 1);
+         }
+      }
+
+      void block(llvm::Function * F, size_t pc) {
+         if (!mBlocks[pc] && pc < mFn.code.size())
+            mBlocks[pc] = llvm::BasicBlock::Create(mB.getContext(), "", F);
+      }
+
+      llvm::Value * get(int reg) {
+         return mB.CreateLoad(mI64, mRegs[reg]);
+      }
+
+      void set(int reg, llvm::Value * val) {
+         mB.CreateStore(val, mRegs[reg]);
+      }
+
+      llvm::Value * pointer(llvm::Value * addr, unsigned bits) {
+         llvm::Value * p = mB.CreateInBoundsGEP(mB.getInt8Ty(), mMem, addr);
+         return mB.CreateBitCast(p, mB.getIntNTy(bits)->getPointerTo());
+      }
+
+      llvm::Value * load(llvm::Value * addr, unsigned bits) {
+         llvm::Type * type = mB.getIntNTy(bits);
+         llvm::Value * val = mB.CreateAlignedLoad(type, pointer(addr, bits), llvm::MaybeAlign(1));
+         return bits == 64 ? val : mB.CreateSExt(val, mI64);
+      }
+
+      void store(llvm::Value * addr, llvm::Value * val, unsigned bits) {
+         if (bits != 64) val = mB.CreateTrunc(val, mB.getIntNTy(bits));
+         mB.CreateAlignedStore(val, pointer(addr, bits), llvm::MaybeAlign(1));
+      }
+
+      llvm::Value * global(int slot) {
+         return mB.CreateConstInBoundsGEP1_64(mI64, mGlobals, slot);
+      }
+
+      void branch(llvm::Value * cond, int target, size_t next) {
+         mB.CreateCondBr(cond, blockAt(target), blockAt(next));
+      }
+
+      static llvm::CmpInst::Predicate predicate(int cmp) {
+         static const llvm::CmpInst::Predicate preds[] = {
+            llvm::CmpInst::ICMP_SLT, llvm::CmpInst::ICMP_SGT, llvm::CmpInst::ICMP_SLE,
+            llvm::CmpInst::ICMP_SGE, llvm::CmpInst::ICMP_EQ, llvm::CmpInst::ICMP_NE
+         };
+         return preds[cmp];
+      }
+
+      void instruction(const Instr & I) {
+         size_t next = &I - mFn.code.data() + 1;
+         switch (I.op) {
+         case OP_NOP: break;
+         case OP_LOADK: set(I.a, mB.getInt64(mFn.consts[I.b])); break;
+         case OP_MOV: set(I.a, get(I.b)); break;
+         case OP_LOADGLOBAL: set(I.a, mB.CreateLoad(mI64, global(I.b))); break;
+         case OP_STOREGLOBAL: mB.CreateStore(get(I.b), global(I.a)); break;
+         case OP_FRAMEADDR: set(I.a, mB.CreateAdd(mFp, mB.getInt64(I.b))); break;
+         case OP_ZERO:
+            mB.CreateCall(runtime("rt.zero", mB.getVoidTy(), { mI8Ptr, mI64, mI64 }),
+                          { mCtx, get(I.a), mB.getInt64(I.b) });
+            break;
+         case OP_LOAD8: set(I.a, load(get(I.b), 8)); break;
+         case OP_LOAD32: set(I.a, load(get(I.b), 32)); break;
+         case OP_LOAD64: set(I.a, load(get(I.b), 64)); break;
+         case OP_STORE8: store(get(I.a), get(I.b), 8); break;
+         case OP_STORE32: store(get(I.a), get(I.b), 32); break;
+         case OP_STORE64: store(get(I.a), get(I.b), 64); break;
+         case OP_SEXT8: set(I.a, mB.CreateSExt(mB.CreateTrunc(get(I.b), mB.getInt8Ty()), mI64)); break;
+         case OP_SEXT32: set(I.a, mB.CreateSExt(mB.CreateTrunc(get(I.b), mB.getInt32Ty()), mI64)); break;
+         case OP_NEG: set(I.a, mB.CreateNeg(get(I.b))); break;
+         case OP_NOT: set(I.a, mB.CreateNot(get(I.b))); break;
+         case OP_LNOT: set(I.a, mB.CreateZExt(mB.CreateIsNull(get(I.b)), mI64)); break;
+         case OP_ADD: set(I.a, mB.CreateAdd(get(I.b), get(I.c))); break;
+         case OP_SUB: set(I.a, mB.CreateSub(get(I.b), get(I.c))); break;
+         case OP_MUL: set(I.a, mB.CreateMul(get(I.b), get(I.c))); break;
+         case OP_DIV: set(I.a, mB.CreateSDiv(get(I.b), get(I.c))); break;
+         case OP_REM: set(I.a, mB.CreateSRem(get(I.b), get(I.c))); break;
+         /// Shift counts wrap at 64 like in the interpreter
+         case OP_SHL:
+            set(I.a, mB.CreateShl(get(I.b), mB.CreateAnd(get(I.c), mB.getInt64(63))));
+            break;
+         case OP_SHR:
+            set(I.a, mB.CreateAShr(get(I.b), mB.CreateAnd(get(I.c), mB.getInt64(63))));
+            break;
+         case OP_AND: set(I.a, mB.CreateAnd(get(I.b), get(I.c))); break;
+         case OP_OR: set(I.a, mB.CreateOr(get(I.b), get(I.c))); break;
+         case OP_XOR: set(I.a, mB.CreateXor(get(I.b), get(I.c))); break;
+         case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+            set(I.a, mB.CreateZExt(mB.CreateICmp(predicate(I.op - OP_LT), get(I.b), get(I.c)),
+                                   mI64));
+            break;
+         case OP_JMP: mB.CreateBr(blockAt(I.a)); break;
+         case OP_JZ: branch(mB.CreateIsNull(get(I.a)), I.b, next); break;
+         case OP_JNZ: branch(mB.CreateIsNotNull(get(I.a)), I.b, next); break;
+         case OP_ADDK: set(I.a, mB.CreateAdd(get(I.b), mB.getInt64(I.c))); break;
+         case OP_MULK: set(I.a, mB.CreateMul(get(I.b), mB.getInt64(I.c))); break;
+         case OP_JLT: case OP_JGT: case OP_JLE: case OP_JGE: case OP_JEQ: case OP_JNE:
+            branch(mB.CreateICmp(predicate(I.op - OP_JLT), get(I.a), get(I.b)), I.c, next);
+            break;
+         case OP_JLTK: case OP_JGTK: case OP_JLEK: case OP_JGEK: case OP_JEQK: case OP_JNEK:
+            branch(mB.CreateICmp(predicate(I.op - OP_JLTK), get(I.a), mB.getInt64(I.b)),
+                   I.c, next);
+            break;
+         case OP_CALL: set(I.a, call(I)); break;
+         /// OSR code lets the interpreter do the return
+         case OP_RET: case OP_RETVOID:
+            if (mFirst >= 0) mB.CreateBr(exit(next - 1));
+            else epilogue(I.op == OP_RET ? get(I.a) : mB.getInt64(0));
+            break;
+         case OP_GET:
+            set(I.a, mB.CreateCall(runtime("rt.get", mI64, { mI8Ptr }), { mCtx }));
+            break;
+         case OP_PRINT:
+            mB.CreateCall(runtime("rt.print", mB.getVoidTy(), { mI8Ptr, mI64 }),
+                          { mCtx, get(I.a) });
+            break;
+         case OP_MALLOC:
+            set(I.a, mB.CreateCall(runtime("rt.malloc", mI64, { mI8Ptr, mI64 }),
+                                   { mCtx, get(I.b) }));
+            break;
+         case OP_FREE:
+            mB.CreateCall(runtime("rt.free", mB.getVoidTy(), { mI8Ptr, mI64 }),
+                          { mCtx, get(I.a) });
+            break;
+         case OP_VEC32: {
+            llvm::Value * y = (I.c & Vector::kOpMask) == OP_MOV ? mB.getInt64(0) : get(I.b + 3);
+            set(I.a, mB.CreateCall(runtime("rt.vec32", mI64,
+                                           { mI8Ptr, mI64, mI64, mI64, mI64, mI64, mI64 }),
+                                   { mCtx, mB.getInt64(I.c), get(I.a), get(I.b), get(I.b + 1),
+                                     get(I.b + 2), y }));
+            break;
+         }
+         default:
+            llvm::report_fatal_error(llvm::Twine("cannot compile opcode ") + opcodeName(I.op));
+         }
+      }
+
+      /// Compiled callees are called directly, the others through the VM
+      llvm::Value * call(const Instr & I) {
+         unsigned numParams = mJit.mProg.functions[I.b].numParams;
+         if ((I.b == mIndex && mFirst < 0) || mJit.mCompiled[I.b]) {
+            std::vector<llvm::Value *> args(1, mCtx);
+            for (unsigned i = 0; i < numParams; ++i)
+               args.push_back(get(I.c + i));
+            return mB.CreateCall(body(I.b), args);
+         }
+         for (unsigned i = 0; i < numParams; ++i)
+            mB.CreateStore(get(I.c + i), mB.CreateConstInBoundsGEP1_64(mI64, mArgs, i));
+         llvm::Value * args = mArgs ? mArgs : llvm::ConstantPointerNull::get(mI64->getPointerTo());
+         return mB.CreateCall(runtime("rt.call", mI64, { mI8Ptr, mI64, mI64->getPointerTo() }),
+                              { mCtx, mB.getInt64(I.b), args });
+      }
+
+      /// fn<N>.entry(ctx, args) unpacks the arguments and calls fn<N>
+      void entryThunk(llvm::Function * F) {
+         llvm::FunctionType * type = llvm::FunctionType::get(
+            mI64, { mI8Ptr, mI64->getPointerTo() }, false);
+         llvm::Function * thunk = llvm::Function::Create(
+            type, llvm::Function::ExternalLinkage, bodyName(mIndex) + ".entry", &mModule);
+         mB.SetInsertPoint(llvm::BasicBlock::Create(mB.getContext(), "", thunk));
+         llvm::Function::arg_iterator arg = thunk->arg_begin();
+         std::vector<llvm::Value *> args(1, &*arg++);
+         llvm::Value * argv = &*arg;
+         for (unsigned i = 0; i < mFn.numParams; ++i)
+            args.push_back(mB.CreateLoad(mI64, mB.CreateConstInBoundsGEP1_64(mI64, argv, i)));
+         mB.CreateRet(mB.CreateCall(F, args));
+      }
+   };
+
+public:
+   /// The JIT for \p prog, NULL if native code cannot be generated here.
+   /// Every VM has a JIT of its own, and they may be created on several
+   /// threads at once.
+   static std::unique_ptr<JIT> create(const Program & prog) {
+      static const bool initialized = initializeTarget();
+      (void) initialized;
+      llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> jit = llvm::orc::LLJITBuilder().create();
+      if (!jit) {
+         Diag << "jit unavailable: " << llvm::toString(jit.takeError()) << "\n";
+         return NULL;
+      }
+      std::unique_ptr<JIT> tier(new JIT(prog, std::move(*jit)));
+      if (llvm::Error err = tier->bindRuntime()) {
+         Diag << "jit unavailable: " << llvm::toString(std::move(err)) << "\n";
+         return NULL;
+      }
+      return tier;
+   }
+
+   /// Compile function \p index, NULL if that failed
+   Entry compile(int index) {
+      std::unique_ptr<llvm::LLVMContext> context(new llvm::LLVMContext());
+      std::unique_ptr<llvm::Module> module(new llvm::Module(bodyName(index), *context));
+      module->setDataLayout(mJIT->getDataLayout());
+      Translator(*this, index, *module).translate();
+      Entry entry = (Entry) add(std::move(module), std::move(context), bodyName(index) + ".entry");
+      if (entry) mCompiled[index] = true;
+      return entry;
+   }
+
+   /// Compile the loop of function \p index from \p header to the
+   /// back-edge at \p backEdge for OSR, NULL if that failed
+   OsrEntry compileLoop(int index, int header, int backEdge) {
+      std::unique_ptr<llvm::LLVMContext> context(new llvm::LLVMContext());
+      std::unique_ptr<llvm::Module> module(new llvm::Module(osrName(index, header), *context));
+      module->setDataLayout(mJIT->getDataLayout());
+      Translator(*this, index, *module, header, backEdge).translate();
+      return (OsrEntry) add(std::move(module), std::move(context), osrName(index, header));
+   }
+
+private:
+   /// Optimize \p module, hand it to ORC and look up \p symbol in it
+   llvm::JITTargetAddress add(std::unique_ptr<llvm::Module> module,
+                              std::unique_ptr<llvm::LLVMContext> context,
+                              const std::string & symbol) {
+      if (llvm::verifyModule(*module, &llvm::errs()))
+         llvm::report_fatal_error("jit produced invalid IR for " + module->getName());
+      optimize(*module);
+      if (DEBUG) module->print(llvm::errs(), NULL);
+
+      llvm::orc::ThreadSafeModule tsm(std::move(module), std::move(context));
+      if (llvm::Error err = mJIT->addIRModule(std::move(tsm))) {
+         Diag << "jit failed: " << llvm::toString(std::move(err)) << "\n";
+         return 0;
+      }
+      llvm::Expected<llvm::JITEvaluatedSymbol> sym = mJIT->lookup(symbol);
+      if (!sym) {
+         Diag << "jit failed: " << llvm::toString(sym.takeError()) << "\n";
+         return 0;
+      }
+      return sym->getAddress();
+   }
+
+   static void optimize(llvm::Module & module) {
+      llvm::PassManagerBuilder builder;
+      builder.OptLevel = 2;
+      llvm::legacy::FunctionPassManager fpm(&module);
+      llvm::legacy::PassManager mpm;
+      builder.populateFunctionPassManager(fpm);
+      builder.populateModulePassManager(mpm);
+      fpm.doInitialization();
+      for (llvm::Function & F : module)
+         fpm.run(F);
+      fpm.doFinalization();
+      mpm.run(module);
+   }
+};
+
+#endif
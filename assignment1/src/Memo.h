@@ -0,0 +1,181 @@
+//==--- Memo.h - Memoizing calls of pure functions -------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_MEMO_H
+#define AST_INTERPRETER_MEMO_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// Decides which functions are pure: their result depends on nothing but
+/// their arguments and calling them has no effect besides it.  The
+/// analysis looks at the bytecode, where that means a function touches
+/// only its registers, no memory, globals, GET, PRINT, MALLOC or FREE,
+/// and calls only pure functions.  Functions are analyzed on demand
+/// together with everything they call, which lowers those if they are
+/// still stubs.
+class Purity {
+   enum State : uint8_t { Unknown, Pure, Impure };
+
+   const Program & mProg;
+   std::vector<State> mState;
+
+   static bool hasEffects(const Function & fn) {
+      for (const Instr & I : fn.code) {
+         switch (I.op) {
+         case OP_LOADGLOBAL: case OP_STOREGLOBAL: case OP_FRAMEADDR: case OP_ZERO:
+         case OP_LOAD8: case OP_LOAD32: case OP_LOAD64:
+         case OP_STORE8: case OP_STORE32: case OP_STORE64:
+         case OP_GET: case OP_PRINT: case OP_MALLOC: case OP_FREE: case OP_VEC32:
+            return true;
+         default:
+            break;
+         }
+      }
+      return false;
+   }
+public:
+   explicit Purity(const Program & prog)
+      : mProg(prog), mState(prog.functions.size(), Unknown) {}
+
+   bool isPure(int index) {
+      if (mState[index] != Unknown) return mState[index] == Pure;
+      /// Collect the functions \p index can reach whose state is open
+      std::vector<int> open(1, index);
+      mState[index] = Pure;
+      for (size_t i = 0; i < open.size(); ++i) {
+         const Function & fn = mProg.function(open[i]);
+         if (hasEffects(fn)) mState[open[i]] = Impure;
+         for (const Instr & I : fn.code)
+            if (I.op == OP_CALL && mState[I.b] == Unknown) {
+               mState[I.b] = Pure;
+               open.push_back(I.b);
+            }
+      }
+      /// Then spread impurity to the callers until nothing changes, which
+      /// leaves recursive functions pure if nothing in the cycle has effects
+      for (bool changed = true; changed; ) {
+         changed = false;
+         for (int fn : open) {
+            if (mState[fn] == Impure) continue;
+            for (const Instr & I : mProg.functions[fn].code)
+               if (I.op == OP_CALL && mState[I.b] == Impure) {
+                  mState[fn] = Impure;
+                  changed = true;
+                  break;
+               }
+         }
+      }
+      return mState[index] == Pure;
+   }
+};
+
+/// What a MemoTable did
+struct MemoStats {
+   unsigned long long hits;
+   unsigned long long misses;
+   unsigned long long evictions;
+
+   MemoStats() : hits(0), misses(0), evictions(0) {}
+
+   void print(llvm::raw_ostream & os) const {
+      unsigned long long calls = hits + misses;
+      os << "memo: " << calls << " calls, " << hits << " hits ("
+         << (calls ? hits * 100 / calls : 0) << "%), " << misses << " misses, "
+         << evictions << " evictions\n";
+   }
+};
+
+/// Results of pure calls by function and arguments.  The table has a fixed
+/// number of entries and a call may only sit in the few entries after the
+/// one its hash picks, so a full neighbourhood evicts the entry that was
+/// used least recently.
+class MemoTable {
+public:
+   /// Functions with more parameters are not memoized
+   static const unsigned kMaxArgs = 4;
+   static const unsigned kProbes = 4;
+   static const unsigned kDefaultEntries = 1u << 16;
+private:
+   struct Entry {
+      int fn;              /// -1 if the entry is free
+      unsigned age;
+      LL args[kMaxArgs];
+      LL val;
+   };
+
+   std::vector<Entry> mEntries;
+   size_t mMask;
+   unsigned mClock;
+   MemoStats mStats;
+
+   static uint64_t hash(int fn, const LL * args, unsigned numArgs) {
+      uint64_t h = (uint64_t) fn * 0x9E3779B97F4A7C15ull;
+      for (unsigned i = 0; i < numArgs; ++i)
+         h = (h ^ (uint64_t) args[i]) * 0xFF51AFD7ED558CCDull;
+      return h ^ (h >> 29);
+   }
+
+   static bool matches(const Entry & e, int fn, const LL * args, unsigned numArgs) {
+      if (e.fn != fn) return false;
+      for (unsigned i = 0; i < numArgs; ++i)
+         if (e.args[i] != args[i]) return false;
+      return true;
+   }
+public:
+   /// A table of at least \p entries entries, rounded up to a power of two
+   explicit MemoTable(unsigned entries = kDefaultEntries)
+      : mEntries(), mMask(0), mClock(0), mStats() {
+      size_t size = kProbes;
+      while (size < entries) size *= 2;
+      Entry free = { -1, 0, {0}, 0 };
+      mEntries.assign(size, free);
+      mMask = size - 1;
+   }
+
+   /// The result of \p fn for \p args if it is known, which makes it the
+   /// most recently used entry
+   bool lookup(int fn, const LL * args, unsigned numArgs, LL & val) {
+      size_t at = hash(fn, args, numArgs);
+      for (unsigned i = 0; i < kProbes; ++i) {
+         Entry & e = mEntries[(at + i) & mMask];
+         if (matches(e, fn, args, numArgs)) {
+            e.age = ++mClock;
+            val = e.val;
+            ++mStats.hits;
+            return true;
+         }
+      }
+      ++mStats.misses;
+      return false;
+   }
+
+   void insert(int fn, const LL * args, unsigned numArgs, LL val) {
+      size_t at = hash(fn, args, numArgs);
+      Entry * victim = NULL;
+      for (unsigned i = 0; i < kProbes; ++i) {
+         Entry & e = mEntries[(at + i) & mMask];
+         if (e.fn < 0 || matches(e, fn, args, numArgs)) {
+            victim = &e;
+            break;
+         }
+         if (!victim || e.age < victim->age) victim = &e;
+      }
+      if (victim->fn >= 0 && !matches(*victim, fn, args, numArgs)) ++mStats.evictions;
+      victim->fn = fn;
+      victim->age = ++mClock;
+      std::copy(args, args + numArgs, victim->args);
+      victim->val = val;
+   }
+
+   const MemoStats & stats() const {
+      return mStats;
+   }
+};
+
+#endif
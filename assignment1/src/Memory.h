@@ -0,0 +1,421 @@
+//==--- Memory.h - Address space of the interpreted program ----------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_MEMORY_H
+#define AST_INTERPRETER_MEMORY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// The interpreted program's memory is one range of host memory reserved up
+/// front, and interpreter addresses are byte offsets into it, so pointer
+/// arithmetic and dereference are plain host loads and stores.  Address 0
+/// is NULL and the page holding it is inaccessible.  The range is
+/// kReserve by default; a smaller one lets many Memories exist at once,
+/// like those of executions interleaved by a Scheduler.
+///
+/// Above the NULL page come the global data, whose addresses the compiler
+/// fixes, then the slabs of the MALLOC heap.  The data frames of calls are
+/// pushed on a stack growing down from the end of the range.
+///
+/// A slab is kSlabBytes, aligned to its size, and holds blocks of one size
+/// class: multiples of 16 bytes up to 256, then powers of two up to
+/// kMaxSmall.  A class hands out the blocks FREE gave back first, most
+/// recent first, then bumps through its newest slab, so blocks need no
+/// header and allocating is a few loads and stores.  Larger blocks are
+/// runs of whole slabs, reused best fit once freed.  A table by slab tells
+/// FREE the class of a block.  FREE of anything but a block MALLOC handed
+/// out and that is not free is a fatal error: the address has to be at a
+/// multiple of its class from the slab's start and below where the class
+/// bumps.  A free block holds the next one on its list and a tag made from
+/// its address, so FREE only walks the list to tell a block freed twice
+/// from one whose data happens to look like the tag.
+///
+/// A guarded Memory is PROT_NONE except where the program may access it,
+/// with as much again of it on both sides, so a stray access faults
+/// instead of reaching other data and a Guard can report it.  The data
+/// frames and the global data are accessible as they are taken, and a
+/// MALLOC block gets pages of its own, followed by an inaccessible guard
+/// page, and ends as close to it as kAlign allows.  FREE protects a
+/// block's pages and hands them back to the kernel; they are only reused
+/// once kQuarantineBytes of blocks were freed after them.  Accesses to
+/// the rest of the first page of a block, to its alignment padding or to
+/// data frames that were popped are not caught.
+class Memory {
+public:
+   /// Address space a Memory reserves by default, and at most
+   static const LL kReserve = 1LL << 32;
+   static const LL kPageSize = 4096;
+   static const LL kDataBase = kPageSize;
+   static const LL kAlign = 16;
+   static const LL kSlabBytes = 64 * 1024;
+   static const LL kMaxSmall = 16 * 1024;
+   /// Zeroing at least this many bytes hands whole pages back to the
+   /// kernel instead, which maps them in zeroed on first touch
+   static const LL kLazyZeroBytes = 64 * 1024;
+   /// Pages of freed guarded blocks kept inaccessible before reuse
+   static const LL kQuarantineBytes = 1LL << 30;
+
+   /// What the MALLOC heap holds
+   struct Stats {
+      LL live;             /// bytes of the blocks not freed, by size class
+      LL peak;             /// most live bytes at any time
+      LL slabs;            /// bytes of slabs the heap took
+      unsigned long long mallocs;
+      unsigned long long frees;
+
+      Stats() : live(0), peak(0), slabs(0), mallocs(0), frees(0) {}
+
+      /// Fragmentation is the part of the slabs the peak did not need
+      void print(llvm::raw_ostream & os) const {
+         os << "heap: " << mallocs << " mallocs, " << frees << " frees, " << live
+            << " bytes live, " << peak << " bytes peak, " << slabs << " bytes in slabs ("
+            << (slabs ? (slabs - peak) * 100 / slabs : 0) << "% fragmentation)\n";
+      }
+   };
+private:
+   static const int kClasses = 22;
+   static const uint8_t kLarge = 0xff;
+   /// In the second word of a free block, xor its address
+   static const LL kFreeTag = 0x46524545424c4b21;
+
+   /// The pages of a guarded block, its guard page not counted
+   struct Region {
+      LL pages;
+      LL block;
+      LL size;
+      bool freed;
+   };
+
+   char * mBase;
+   LL mSize;           /// of the range, its end is where the data frames start
+   bool mGuarded;
+   LL mTop;            /// first byte never handed out
+   LL mStackPtr;       /// lowest byte of the innermost data frame
+   LL mFree[kClasses];         /// most recently freed block by class, 0 if none
+   LL mBump[kClasses];         /// next block of the newest slab by class
+   LL mBumpEnd[kClasses];
+   std::vector<uint8_t> mSlabClass;       /// by slab, its class + 1, kLarge
+                                          /// where a large block starts
+   std::vector<uint32_t> mLargeSlabs;     /// by slab, the slabs of the large
+                                          /// block starting there
+   uint64_t mMultiples[kClasses];         /// by class, see isMultiple()
+   std::multimap<LL, LL> mFreeRuns;       /// freed large blocks by slabs, or
+                                          /// freed guarded regions by pages
+   LL mStackLow;                          /// lowest accessible frame page
+   std::map<LL, Region> mRegions;         /// guarded blocks by first page
+   std::deque<LL> mQuarantine;            /// freed regions, oldest first
+   LL mQuarantined;                       /// bytes of them
+   Stats mStats;
+
+   static int sizeClass(LL size) {
+      if (size <= 256) return size ? (size - 1) / 16 : 0;
+      int c = 16;
+      for (LL bytes = 512; bytes < size; bytes *= 2) ++c;
+      return c;
+   }
+
+   static LL classBytes(int c) {
+      return c < 16 ? (c + 1) * 16 : LL(512) << (c - 16);
+   }
+
+   /// Whether \p offset in a slab is a multiple of the size of class \p c,
+   /// by a multiplication with 2^64 / size rounded up instead of a division
+   bool isMultiple(LL offset, int c) const {
+      return (uint64_t) offset * mMultiples[c] <= mMultiples[c] - 1;
+   }
+
+   /// Whether \p block is on the free list of class \p c
+   bool isFree(LL block, int c) const {
+      for (LL free = mFree[c]; free; free = load64(mBase + free))
+         if (free == block) return true;
+      return false;
+   }
+
+   /// \p bytes as the size of a Memory
+   static LL rounded(LL bytes) {
+      bytes = (bytes + kSlabBytes - 1) & ~(kSlabBytes - 1);
+      return bytes < kSlabBytes ? kSlabBytes : bytes > kReserve ? kReserve : bytes;
+   }
+
+   /// Take \p count fresh slabs above the global data
+   LL newSlabs(LL count) {
+      if (mSlabClass.empty()) {
+         mSlabClass.assign(mSize / kSlabBytes, 0);
+         mLargeSlabs.assign(mSize / kSlabBytes, 0);
+      }
+      LL slab = (mTop + kSlabBytes - 1) & ~(kSlabBytes - 1);
+      if (slab + count * kSlabBytes > mStackPtr)
+         llvm::report_fatal_error("interpreter out of memory");
+      mTop = slab + count * kSlabBytes;
+      mStats.slabs += count * kSlabBytes;
+      return slab;
+   }
+
+   LL mallocLarge(LL size) {
+      LL count = (size + kSlabBytes - 1) / kSlabBytes;
+      LL block;
+      std::multimap<LL, LL>::iterator run = mFreeRuns.lower_bound(count);
+      if (run != mFreeRuns.end()) {
+         block = run->second;
+         if (run->first > count)
+            mFreeRuns.insert(std::make_pair(run->first - count, block + count * kSlabBytes));
+         mFreeRuns.erase(run);
+      } else {
+         block = newSlabs(count);
+      }
+      mSlabClass[block / kSlabBytes] = kLarge;
+      mLargeSlabs[block / kSlabBytes] = count;
+      taken(count * kSlabBytes);
+      return block;
+   }
+
+   /// Give a guarded block of \p size bytes pages of its own plus a guard
+   /// page, from a region out of quarantine if one is large enough
+   LL mallocGuarded(LL size) {
+      LL bytes = (size + kAlign - 1) & ~(kAlign - 1);
+      LL pages = std::max((bytes + kPageSize - 1) / kPageSize, LL(1));
+      LL region;
+      std::multimap<LL, LL>::iterator run = mFreeRuns.lower_bound(pages + 1);
+      if (run != mFreeRuns.end()) {
+         region = run->second;
+         /// What is left needs a data page and a guard page to be of use
+         if (run->first > pages + 2)
+            mFreeRuns.insert(std::make_pair(run->first - pages - 1,
+                                            region + (pages + 1) * kPageSize));
+         mFreeRuns.erase(run);
+      } else {
+         region = mTop;
+         if (region + (pages + 1) * kPageSize > mStackLow)
+            llvm::report_fatal_error("interpreter out of memory");
+         mTop = region + (pages + 1) * kPageSize;
+         mStats.slabs += (pages + 1) * kPageSize;
+      }
+      mprotect(mBase + region, pages * kPageSize, PROT_READ | PROT_WRITE);
+      Region r = { pages, region + pages * kPageSize - bytes, size, false };
+      mRegions[region] = r;
+      taken(pages * kPageSize);
+      return r.block;
+   }
+
+   /// The guarded region holding \p addr or its guard page, NULL if none
+   const std::pair<const LL, Region> * regionOf(LL addr) const {
+      std::map<LL, Region>::const_iterator it = mRegions.upper_bound(addr);
+      if (it == mRegions.begin()) return NULL;
+      --it;
+      return addr < it->first + (it->second.pages + 1) * kPageSize ? &*it : NULL;
+   }
+
+   void freeGuarded(LL addr) {
+      const std::pair<const LL, Region> * found = regionOf(addr);
+      if (!found || found->second.block != addr)
+         llvm::report_fatal_error("FREE of an address MALLOC did not return");
+      if (found->second.freed)
+         llvm::report_fatal_error("FREE of a block that was already FREEd");
+      LL region = found->first;
+      Region & r = mRegions[region];
+      r.freed = true;
+      mprotect(mBase + region, r.pages * kPageSize, PROT_NONE);
+      madvise(mBase + region, r.pages * kPageSize, MADV_DONTNEED);
+      given(r.pages * kPageSize);
+      mQuarantine.push_back(region);
+      mQuarantined += r.pages * kPageSize;
+      while (mQuarantined > kQuarantineBytes) {
+         LL oldest = mQuarantine.front();
+         mQuarantine.pop_front();
+         LL pages = mRegions[oldest].pages;
+         mQuarantined -= pages * kPageSize;
+         mRegions.erase(oldest);
+         mFreeRuns.insert(std::make_pair(pages + 1, oldest));
+      }
+   }
+
+   void taken(LL bytes) {
+      ++mStats.mallocs;
+      mStats.live += bytes;
+      if (mStats.live > mStats.peak) mStats.peak = mStats.live;
+   }
+
+   void given(LL bytes) {
+      ++mStats.frees;
+      mStats.live -= bytes;
+   }
+public:
+   /// A Memory of \p bytes, rounded up to whole slabs and at most kReserve
+   explicit Memory(bool guarded = false, LL bytes = kReserve)
+      : mBase(NULL), mSize(rounded(bytes)), mGuarded(guarded), mTop(kDataBase),
+        mStackPtr(mSize), mFree(), mBump(), mBumpEnd(), mSlabClass(), mLargeSlabs(), mMultiples(), mFreeRuns(),
+        mStackLow(mSize), mRegions(), mQuarantine(), mQuarantined(0), mStats() {
+      for (int c = 0; c < kClasses; ++c)
+         mMultiples[c] = UINT64_MAX / classBytes(c) + 1;
+      void * base = mmap(NULL, mSize + 2 * guardBytes(),
+                         mGuarded ? PROT_NONE : PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (base == MAP_FAILED)
+         llvm::report_fatal_error("cannot reserve the interpreter address space");
+      mBase = (char *) base + guardBytes();
+      if (!mGuarded) mprotect(mBase, kPageSize, PROT_NONE);
+   }
+
+   ~Memory() {
+      munmap(mBase - guardBytes(), mSize + 2 * guardBytes());
+   }
+
+   Memory(const Memory &) = delete;
+   Memory & operator=(const Memory &) = delete;
+
+   char * base() {
+      return mBase;
+   }
+
+   bool guarded() const {
+      return mGuarded;
+   }
+
+   /// Bytes of the range addresses are in
+   LL size() const {
+      return mSize;
+   }
+
+   /// Bytes of the inaccessible range on either side, 0 if not guarded
+   LL guardBytes() const {
+      return mGuarded ? mSize : 0;
+   }
+
+   /// Set aside the global data, which is still untouched and so zero.
+   /// Guarded, a guard page follows it.
+   void reserveData(LL bytes) {
+      mTop = kDataBase + (bytes + kAlign - 1) / kAlign * kAlign;
+      if (mTop > mStackPtr) llvm::report_fatal_error("interpreter out of memory");
+      if (!mGuarded) return;
+      LL end = (mTop + kPageSize - 1) & ~(kPageSize - 1);
+      mprotect(mBase + kDataBase, end - kDataBase, PROT_READ | PROT_WRITE);
+      mTop = end + kPageSize;
+   }
+
+   LL pushFrame(LL bytes) {
+      if (mStackPtr - bytes < mTop)
+         llvm::report_fatal_error("interpreter stack overflow");
+      mStackPtr -= bytes;
+      if (mGuarded && mStackPtr < mStackLow) {
+         LL low = mStackPtr & ~(kPageSize - 1);
+         mprotect(mBase + low, mStackLow - low, PROT_READ | PROT_WRITE);
+         mStackLow = low;
+      }
+      return mStackPtr;
+   }
+
+   void popFrame(LL bytes) {
+      mStackPtr += bytes;
+   }
+
+   void zero(LL addr, LL bytes) {
+      char * p = mBase + addr;
+      if (bytes < kLazyZeroBytes) {
+         memset(p, 0, bytes);
+         return;
+      }
+      char * first = (char *) (((uintptr_t) p + kPageSize - 1) & ~(uintptr_t) (kPageSize - 1));
+      char * last = (char *) (((uintptr_t) p + bytes) & ~(uintptr_t) (kPageSize - 1));
+      memset(p, 0, first - p);
+      madvise(first, last - first, MADV_DONTNEED);
+      memset(last, 0, p + bytes - last);
+   }
+
+   LL Malloc(LL size) {
+      if (size < 0)
+         llvm::report_fatal_error("MALLOC of a negative size");
+      if (mGuarded) return mallocGuarded(size);
+      if (size > kMaxSmall) return mallocLarge(size);
+      int c = sizeClass(size);
+      LL bytes = classBytes(c);
+      LL block = mFree[c];
+      if (block) {
+         mFree[c] = load64(mBase + block);
+         store64(mBase + block + 8, 0);
+      } else {
+         if (mBump[c] + bytes > mBumpEnd[c]) {
+            mBump[c] = newSlabs(1);
+            mBumpEnd[c] = mBump[c] + kSlabBytes;
+            mSlabClass[mBump[c] / kSlabBytes] = c + 1;
+         }
+         block = mBump[c];
+         mBump[c] += bytes;
+      }
+      taken(bytes);
+      return block;
+   }
+
+   void Free(LL addr) {
+      if (!addr) return;
+      if (mGuarded) {
+         freeGuarded(addr);
+         return;
+      }
+      uint8_t c = addr > 0 && addr < mSize && !mSlabClass.empty()
+                  ? mSlabClass[addr / kSlabBytes] : 0;
+      if (!c || (c == kLarge && addr % kSlabBytes))
+         llvm::report_fatal_error("FREE of an address MALLOC did not return");
+      if (c == kLarge) {
+         LL count = mLargeSlabs[addr / kSlabBytes];
+         mSlabClass[addr / kSlabBytes] = 0;
+         /// A freed large block goes back to the kernel and comes back zeroed
+         madvise(mBase + addr, count * kSlabBytes, MADV_DONTNEED);
+         mFreeRuns.insert(std::make_pair(count, addr));
+         given(count * kSlabBytes);
+         return;
+      }
+      LL bytes = classBytes(c - 1);
+      LL slab = addr & ~(kSlabBytes - 1);
+      LL offset = addr - slab;
+      if (!isMultiple(offset, c - 1) || offset + bytes > kSlabBytes ||
+          (slab == mBumpEnd[c - 1] - kSlabBytes && addr >= mBump[c - 1]))
+         llvm::report_fatal_error("FREE of an address MALLOC did not return");
+      if (load64(mBase + addr + 8) == (addr ^ kFreeTag) && isFree(addr, c - 1))
+         llvm::report_fatal_error("FREE of a block that was already FREEd");
+      store64(mBase + addr, mFree[c - 1]);
+      store64(mBase + addr + 8, addr ^ kFreeTag);
+      mFree[c - 1] = addr;
+      given(bytes);
+   }
+
+   const Stats & stats() const {
+      return mStats;
+   }
+
+   /// What the program accessed at \p addr, for reporting a fault there
+   std::string describe(LL addr) const {
+      std::string what = "address " + std::to_string(addr);
+      if (addr >= 0 && addr < kPageSize) return what + ", in the NULL page";
+      if (addr < 0 || addr >= mSize) return what + ", outside the interpreter's memory";
+      if (const std::pair<const LL, Region> * found = regionOf(addr)) {
+         const Region & r = found->second;
+         what += ", at offset " + std::to_string(addr - r.block) + " of the " +
+                 std::to_string(r.size) + "-byte block at " + std::to_string(r.block);
+         return r.freed ? what + ", which was FREEd" : what;
+      }
+      return what + ", which the program never allocated";
+   }
+
+   /// Typed accesses, sign extending like the char, int and pointer
+   /// types they implement
+   static LL load8(const char * p) { return *(const int8_t *) p; }
+   static LL load32(const char * p) { int32_t v; memcpy(&v, p, 4); return v; }
+   static LL load64(const char * p) { int64_t v; memcpy(&v, p, 8); return v; }
+   static void store8(char * p, LL v) { *p = (char) v; }
+   static void store32(char * p, LL v) { int32_t t = (int32_t) v; memcpy(p, &t, 4); }
+   static void store64(char * p, LL v) { int64_t t = v; memcpy(p, &t, 8); }
+};
+
+#endif
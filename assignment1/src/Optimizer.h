@@ -0,0 +1,386 @@
+//==--- Optimizer.h - Bytecode optimizations run before execution ---------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_OPTIMIZER_H
+#define AST_INTERPRETER_OPTIMIZER_H
+
+#include <vector>
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+#include "Vector.h"
+
+/// What the Optimizer did to a Program
+struct OptimizerStats {
+   unsigned before;       /// instructions before optimizing
+   unsigned after;        /// instructions left
+   unsigned folded;       /// computed or decided at compile time
+   unsigned immediates;   /// constant operands turned into immediates
+   unsigned fused;        /// compare and branch pairs fused
+   unsigned removed;      /// dead instructions and jumps to the next one
+
+   OptimizerStats() : before(0), after(0), folded(0), immediates(0), fused(0), removed(0) {}
+
+   void print(llvm::raw_ostream & os) const {
+      os << "optimizer: " << before << " -> " << after << " instructions, "
+         << folded << " folded, " << immediates << " immediate operands, "
+         << fused << " compare+branch fused, " << removed << " removed\n";
+   }
+};
+
+/// Rewrites the lowered functions so they dispatch fewer instructions.
+/// The Compiler already computes sizeof and the scale of pointer
+/// arithmetic; this pass works on what is left of the constants:
+///
+///  - folds instructions whose operands are known constants within a
+///    basic block, and branches on a known condition;
+///  - turns small constant operands of add, sub and mul into immediates,
+///    so i = i + 1 is a single OP_ADDK;
+///  - fuses a compare whose only use is the following OP_JZ or OP_JNZ
+///    into one conditional branch;
+///  - removes instructions whose result is dead, then compacts the code.
+class Optimizer {
+   Program & mProg;
+   OptimizerStats mStats;
+
+   Function * mFn;
+   std::vector<bool> mLabels;              /// instruction is a jump target
+   std::vector<llvm::BitVector> mLiveIn;   /// registers live before each instruction
+
+public:
+   explicit Optimizer(Program & prog) : mProg(prog), mStats(), mFn(NULL), mLabels(), mLiveIn() {
+   }
+
+   /// Optimize every function lowered so far
+   const OptimizerStats & run() {
+      for (Function & fn : mProg.functions)
+         if (!fn.code.empty()) optimize(fn);
+      return mStats;
+   }
+
+   /// Optimize \p fn, one function of the Program, adding to the stats
+   const OptimizerStats & optimize(Function & fn) {
+      mFn = &fn;
+      mStats.before += fn.code.size();
+      findLabels();
+      computeLiveness();
+      fold();
+      removeDead();
+      compact();
+      mStats.after += fn.code.size();
+      mFn = NULL;
+      return mStats;
+   }
+
+private:
+   static bool isCompare(Opcode op) {
+      return op >= OP_LT && op <= OP_NE;
+   }
+
+   static bool fitsImmediate(LL val) {
+      return val == (int32_t) val;
+   }
+
+   /// The compare that is true exactly when \p op is false
+   static Opcode invert(Opcode op) {
+      switch (op) {
+      case OP_LT: return OP_GE;
+      case OP_GT: return OP_LE;
+      case OP_LE: return OP_GT;
+      case OP_GE: return OP_LT;
+      case OP_EQ: return OP_NE;
+      default: return OP_EQ;
+      }
+   }
+
+   /// The compare with its operands swapped
+   static Opcode mirror(Opcode op) {
+      switch (op) {
+      case OP_LT: return OP_GT;
+      case OP_GT: return OP_LT;
+      case OP_LE: return OP_GE;
+      case OP_GE: return OP_LE;
+      default: return op;
+      }
+   }
+
+   /// Where \p I keeps its jump target, NULL if it does not jump
+   static int32_t * target(Instr & I) {
+      if (I.op == OP_JMP) return &I.a;
+      if (I.op == OP_JZ || I.op == OP_JNZ) return &I.b;
+      if (I.op >= OP_JLT && I.op <= OP_JNEK) return &I.c;
+      return NULL;
+   }
+
+   /// Register written by \p I, -1 if none
+   static int def(const Instr & I) {
+      switch (I.op) {
+      case OP_LOADK: case OP_MOV: case OP_LOADGLOBAL: case OP_FRAMEADDR:
+      case OP_LOAD8: case OP_LOAD32: case OP_LOAD64: case OP_SEXT8: case OP_SEXT32:
+      case OP_NEG: case OP_NOT: case OP_LNOT: case OP_ADDK: case OP_MULK:
+      case OP_CALL: case OP_GET: case OP_MALLOC: case OP_VEC32:
+         return I.a;
+      default:
+         return I.op >= OP_ADD && I.op <= OP_NE ? I.a : -1;
+      }
+   }
+
+   /// Registers read by \p I
+   void uses(const Instr & I, llvm::SmallVectorImpl<int> & regs) {
+      switch (I.op) {
+      case OP_MOV: case OP_STOREGLOBAL: case OP_LOAD8: case OP_LOAD32: case OP_LOAD64:
+      case OP_SEXT8: case OP_SEXT32: case OP_NEG: case OP_NOT: case OP_LNOT:
+      case OP_MALLOC: case OP_ADDK: case OP_MULK:
+         regs.push_back(I.b);
+         break;
+      case OP_ZERO: case OP_JZ: case OP_JNZ: case OP_RET: case OP_PRINT: case OP_FREE:
+      case OP_JLTK: case OP_JGTK: case OP_JLEK: case OP_JGEK: case OP_JEQK: case OP_JNEK:
+         regs.push_back(I.a);
+         break;
+      case OP_STORE8: case OP_STORE32: case OP_STORE64:
+      case OP_JLT: case OP_JGT: case OP_JLE: case OP_JGE: case OP_JEQ: case OP_JNE:
+         regs.push_back(I.a);
+         regs.push_back(I.b);
+         break;
+      case OP_CALL:
+         for (unsigned i = 0; i < mProg.functions[I.b].numParams; ++i)
+            regs.push_back(I.c + i);
+         break;
+      case OP_VEC32:
+         regs.push_back(I.a);
+         for (int i = 0; i < ((I.c & Vector::kOpMask) == OP_MOV ? 3 : 4); ++i)
+            regs.push_back(I.b + i);
+         break;
+      default:
+         if (I.op >= OP_ADD && I.op <= OP_NE) {
+            regs.push_back(I.b);
+            regs.push_back(I.c);
+         }
+         break;
+      }
+   }
+
+   /// Whether \p I may be dropped when its result is unused.  Loads,
+   /// division and the built-ins stay, as they can trap or have effects.
+   static bool isPure(const Instr & I) {
+      switch (I.op) {
+      case OP_LOADK: case OP_MOV: case OP_LOADGLOBAL: case OP_FRAMEADDR:
+      case OP_SEXT8: case OP_SEXT32: case OP_NEG: case OP_NOT: case OP_LNOT:
+      case OP_ADDK: case OP_MULK:
+         return true;
+      default:
+         return I.op >= OP_ADD && I.op <= OP_NE && I.op != OP_DIV && I.op != OP_REM;
+      }
+   }
+
+   /// The VM's semantics of a binary opcode, false if it must not be folded
+   static bool evaluate(Opcode op, LL x, LL y, LL & result) {
+      switch (op) {
+      case OP_ADD: result = x + y; return true;
+      case OP_SUB: result = x - y; return true;
+      case OP_MUL: result = x * y; return true;
+      case OP_DIV:
+      case OP_REM:
+         if (y == 0 || (y == -1 && x == INT64_MIN)) return false;
+         result = op == OP_DIV ? x / y : x % y;
+         return true;
+      case OP_SHL: result = (LL) ((uint64_t) x << (y & 63)); return true;
+      case OP_SHR: result = x >> (y & 63); return true;
+      case OP_AND: result = x & y; return true;
+      case OP_OR: result = x | y; return true;
+      case OP_XOR: result = x ^ y; return true;
+      case OP_LT: result = x < y; return true;
+      case OP_GT: result = x > y; return true;
+      case OP_LE: result = x <= y; return true;
+      case OP_GE: result = x >= y; return true;
+      case OP_EQ: result = x == y; return true;
+      case OP_NE: result = x != y; return true;
+      default: return false;
+      }
+   }
+
+   void findLabels() {
+      std::vector<Instr> & code = mFn->code;
+      mLabels.assign(code.size() + 1, false);
+      for (Instr & I : code)
+         if (int32_t * to = target(I)) mLabels[*to] = true;
+   }
+
+   llvm::BitVector liveOut(size_t at) {
+      std::vector<Instr> & code = mFn->code;
+      llvm::BitVector live(mFn->numRegs);
+      Instr & I = code[at];
+      if (I.op == OP_RET || I.op == OP_RETVOID) return live;
+      if (int32_t * to = target(I)) live |= mLiveIn[*to];
+      if (I.op != OP_JMP && at + 1 < code.size()) live |= mLiveIn[at + 1];
+      return live;
+   }
+
+   void computeLiveness() {
+      std::vector<Instr> & code = mFn->code;
+      mLiveIn.assign(code.size(), llvm::BitVector(mFn->numRegs));
+      llvm::SmallVector<int, 8> regs;
+      for (bool changed = true; changed; ) {
+         changed = false;
+         for (size_t at = code.size(); at-- > 0; ) {
+            llvm::BitVector live = liveOut(at);
+            int d = def(code[at]);
+            if (d >= 0) live.reset(d);
+            regs.clear();
+            uses(code[at], regs);
+            for (int reg : regs) live.set(reg);
+            if (live != mLiveIn[at]) {
+               mLiveIn[at] = live;
+               changed = true;
+            }
+         }
+      }
+   }
+
+   int addConstant(LL val) {
+      mFn->consts.push_back(val);
+      return mFn->consts.size() - 1;
+   }
+
+   /// Constant propagation within basic blocks, immediates and fusion.
+   /// Every rewrite reads fewer registers, so the liveness computed
+   /// beforehand stays a safe over-approximation throughout.
+   void fold() {
+      std::vector<Instr> & code = mFn->code;
+      std::vector<bool> known(mFn->numRegs, false);
+      std::vector<LL> value(mFn->numRegs, 0);
+      /// Operands of the last compare as they were before it ran
+      bool knownB = false, knownC = false;
+      LL valueB = 0, valueC = 0;
+      for (size_t at = 0; at < code.size(); ++at) {
+         if (mLabels[at]) known.assign(known.size(), false);
+         Instr & I = code[at];
+         if (I.op == OP_LOADK) {
+         } else if (I.op >= OP_SEXT8 && I.op <= OP_LNOT && known[I.b]) {
+            LL x = value[I.b];
+            LL result = I.op == OP_SEXT8 ? (int8_t) x : I.op == OP_SEXT32 ? (int32_t) x
+                      : I.op == OP_NEG ? -x : I.op == OP_NOT ? ~x : !x;
+            I = Instr(OP_LOADK, I.a, addConstant(result));
+            ++mStats.folded;
+         } else if (I.op >= OP_ADD && I.op <= OP_NE) {
+            LL result;
+            if (isCompare(I.op)) {
+               knownB = known[I.b];
+               knownC = known[I.c];
+               valueB = value[I.b];
+               valueC = value[I.c];
+            }
+            if (known[I.b] && known[I.c] && evaluate(I.op, value[I.b], value[I.c], result)) {
+               I = Instr(OP_LOADK, I.a, addConstant(result));
+               ++mStats.folded;
+            } else if (I.op == OP_ADD || I.op == OP_SUB || I.op == OP_MUL) {
+               immediate(I, known, value);
+            }
+         } else if ((I.op == OP_JZ || I.op == OP_JNZ) && known[I.a]) {
+            bool taken = (value[I.a] != 0) == (I.op == OP_JNZ);
+            I = taken ? Instr(OP_JMP, I.b) : Instr(OP_NOP);
+            ++mStats.folded;
+         } else if ((I.op == OP_JZ || I.op == OP_JNZ) && at > 0 && !mLabels[at]) {
+            Instr & cmp = code[at - 1];
+            if (isCompare(cmp.op) && cmp.a == I.a && !liveOut(at).test(I.a)) {
+               Opcode op = I.op == OP_JZ ? invert(cmp.op) : cmp.op;
+               int32_t to = I.b;
+               if (knownC && fitsImmediate(valueC))
+                  I = Instr(Opcode(OP_JLTK + (op - OP_LT)), cmp.b, valueC, to);
+               else if (knownB && fitsImmediate(valueB))
+                  I = Instr(Opcode(OP_JLTK + (mirror(op) - OP_LT)), cmp.c, valueB, to);
+               else
+                  I = Instr(Opcode(OP_JLT + (op - OP_LT)), cmp.b, cmp.c, to);
+               cmp = Instr(OP_NOP);
+               ++mStats.fused;
+            }
+         }
+
+         /// What the registers hold after the instruction
+         if (I.op == OP_LOADK) {
+            known[I.a] = true;
+            value[I.a] = mFn->consts[I.b];
+         } else if (I.op == OP_MOV) {
+            known[I.a] = known[I.b];
+            value[I.a] = value[I.b];
+         } else if (I.op == OP_CALL) {
+            /// The callee's frame overlays every register from rc up
+            for (size_t reg = I.c; reg < known.size(); ++reg) known[reg] = false;
+            known[I.a] = false;
+         } else {
+            int d = def(I);
+            if (d >= 0) known[d] = false;
+         }
+      }
+   }
+
+   /// Turn a constant operand of add, sub or mul into an immediate
+   void immediate(Instr & I, const std::vector<bool> & known, const std::vector<LL> & value) {
+      int reg;
+      LL k;
+      if (known[I.c] && (I.op != OP_SUB || value[I.c] != INT64_MIN)) {
+         reg = I.b;
+         k = I.op == OP_SUB ? -value[I.c] : value[I.c];
+      } else if (known[I.b] && I.op != OP_SUB) {
+         reg = I.c;
+         k = value[I.b];
+      } else return;
+      if (!fitsImmediate(k)) return;
+      I = Instr(I.op == OP_MUL ? OP_MULK : OP_ADDK, I.a, reg, k);
+      ++mStats.immediates;
+   }
+
+   /// Drop pure instructions whose result nothing reads, until none is left
+   void removeDead() {
+      std::vector<Instr> & code = mFn->code;
+      for (bool changed = true; changed; ) {
+         changed = false;
+         computeLiveness();
+         for (size_t at = 0; at < code.size(); ++at) {
+            Instr & I = code[at];
+            bool selfMove = I.op == OP_MOV && I.a == I.b;
+            if (selfMove || (isPure(I) && !liveOut(at).test(I.a))) {
+               I = Instr(OP_NOP);
+               ++mStats.removed;
+               changed = true;
+            }
+         }
+      }
+   }
+
+   /// Remove the NOPs and jumps to the next instruction, retargeting the
+   /// remaining jumps and keeping the line table in step
+   void compact() {
+      std::vector<Instr> & code = mFn->code;
+      std::vector<unsigned> & lines = mFn->lines;
+      bool hasLines = lines.size() == code.size();
+      std::vector<int32_t> next(code.size() + 1);
+      next[code.size()] = code.size();
+      for (size_t at = code.size(); at-- > 0; )
+         next[at] = code[at].op == OP_NOP ? next[at + 1] : at;
+      for (size_t at = 0; at < code.size(); ++at) {
+         Instr & I = code[at];
+         if (I.op == OP_JMP && next[I.a] == next[at + 1]) {
+            I = Instr(OP_NOP);
+            ++mStats.removed;
+         }
+      }
+      std::vector<int32_t> index(code.size() + 1);
+      size_t kept = 0;
+      for (size_t at = 0; at < code.size(); ++at) {
+         index[at] = kept;
+         if (code[at].op == OP_NOP) continue;
+         if (hasLines) lines[kept] = lines[at];
+         code[kept++] = code[at];
+      }
+      index[code.size()] = kept;
+      code.erase(code.begin() + kept, code.end());
+      if (hasLines) lines.resize(kept);
+      for (Instr & I : code)
+         if (int32_t * to = target(I)) *to = index[*to];
+   }
+};
+
+#endif
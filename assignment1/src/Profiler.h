@@ -0,0 +1,194 @@
+//==--- Profiler.h - Calls, time and executed lines of a run ---------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PROFILER_H
+#define AST_INTERPRETER_PROFILER_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+#include "Clock.h"
+
+/// Counts what the interpreter does per function and per source line.
+/// The VM reports every call it enters and leaves and bumps one counter
+/// per instruction it executes, which is all the work done while the
+/// program runs; lines and sorting are only looked at in the report.
+///
+/// Time is inclusive of callees and exclusive of them.  A recursive call
+/// adds to the inclusive time of its function only at the outermost
+/// level, so recursion does not count the same time twice.  Calls are
+/// timed in Clock ticks.  How often a line ran is how often its most
+/// executed instruction did, and its instructions are the work done on it.
+class Profiler {
+   struct FunctionProfile {
+      uint64_t calls;
+      uint64_t inclusive;       /// ticks
+      uint64_t exclusive;
+      unsigned active;          /// calls of it on the stack
+      std::vector<uint64_t> counts;   /// executions by instruction
+   };
+
+   struct Activation {
+      int fn;
+      uint64_t start;
+      uint64_t callees;         /// ticks spent in calls it made
+   };
+
+   /// What ran on one source line of a function
+   struct LineProfile {
+      int fn;
+      unsigned line;
+      uint64_t executions;
+      uint64_t instructions;
+   };
+
+   /// Lines shown in the text report, the JSON file has all of them
+   static const size_t kReportLines = 20;
+
+   const Program & mProg;
+   std::vector<FunctionProfile> mFunctions;
+   std::vector<Activation> mStack;
+   Clock mClock;
+
+   /// The functions that ran, most exclusive time first
+   std::vector<int> functions() const {
+      std::vector<int> ran;
+      for (size_t fn = 0; fn < mFunctions.size(); ++fn)
+         if (mFunctions[fn].calls) ran.push_back(fn);
+      std::stable_sort(ran.begin(), ran.end(), [this](int x, int y) {
+         return mFunctions[x].exclusive > mFunctions[y].exclusive;
+      });
+      return ran;
+   }
+
+   /// The lines that ran, most instructions first
+   std::vector<LineProfile> lines() const {
+      std::vector<LineProfile> ran;
+      for (size_t fn = 0; fn < mFunctions.size(); ++fn) {
+         const std::vector<uint64_t> & counts = mFunctions[fn].counts;
+         const std::vector<unsigned> & table = mProg.functions[fn].lines;
+         std::map<unsigned, LineProfile> byLine;
+         for (size_t pc = 0; pc < counts.size(); ++pc) {
+            if (!counts[pc]) continue;
+            unsigned line = pc < table.size() ? table[pc] : 0;
+            LineProfile & p = byLine.insert(std::make_pair(line, LineProfile{ int(fn), line, 0, 0 }))
+                                 .first->second;
+            p.executions = std::max(p.executions, counts[pc]);
+            p.instructions += counts[pc];
+         }
+         for (const std::pair<const unsigned, LineProfile> & p : byLine)
+            ran.push_back(p.second);
+      }
+      std::stable_sort(ran.begin(), ran.end(), [](const LineProfile & x, const LineProfile & y) {
+         return x.instructions > y.instructions;
+      });
+      return ran;
+   }
+public:
+   explicit Profiler(const Program & prog)
+      : mProg(prog), mFunctions(prog.functions.size(), FunctionProfile()), mStack(),
+        mClock() {}
+
+   /// Start a call of function \p fn, which must be lowered, and return
+   /// its instruction counters
+   uint64_t * enter(int fn) {
+      FunctionProfile & f = mFunctions[fn];
+      if (f.counts.empty()) f.counts.assign(mProg.functions[fn].code.size(), 0);
+      ++f.calls;
+      ++f.active;
+      Activation call = { fn, Clock::ticks(), 0 };
+      mStack.push_back(call);
+      return f.counts.data();
+   }
+
+   /// End the innermost call and return the counters of its caller, NULL
+   /// if it has none
+   uint64_t * leave() {
+      Activation call = mStack.back();
+      mStack.pop_back();
+      uint64_t elapsed = Clock::ticks() - call.start;
+      FunctionProfile & f = mFunctions[call.fn];
+      f.exclusive += elapsed - call.callees;
+      if (!--f.active) f.inclusive += elapsed;
+      if (mStack.empty()) return NULL;
+      mStack.back().callees += elapsed;
+      return mFunctions[mStack.back().fn].counts.data();
+   }
+
+   void report(llvm::raw_ostream & os) const {
+      double ms = mClock.nsPerTick() / 1e6;
+      os << "profile:\n"
+         << "  exclusive ms  inclusive ms         calls  function\n";
+      for (int fn : functions()) {
+         const FunctionProfile & f = mFunctions[fn];
+         os << llvm::format("  %12.3f  %12.3f  %12llu  ", f.exclusive * ms, f.inclusive * ms,
+                            (unsigned long long) f.calls)
+            << mProg.functions[fn].name;
+         if (mProg.functions[fn].line) os << " (line " << mProg.functions[fn].line << ")";
+         os << "\n";
+      }
+      std::vector<LineProfile> ran = lines();
+      os << "  instructions    executions  line  function\n";
+      for (size_t i = 0; i < ran.size() && i < kReportLines; ++i)
+         os << llvm::format("  %12llu  %12llu  %4u  ", (unsigned long long) ran[i].instructions,
+                            (unsigned long long) ran[i].executions, ran[i].line)
+            << mProg.functions[ran[i].fn].name << "\n";
+   }
+
+   /// Write the whole profile as JSON: a "functions" array with the
+   /// calls and the times in ns of every function that ran and a "lines"
+   /// array with every line that ran, sorted like in the report
+   void write(llvm::raw_ostream & os) const {
+      double ns = mClock.nsPerTick();
+      llvm::json::OStream json(os, 1);
+      json.object([&] {
+         json.attributeArray("functions", [&] {
+            for (int fn : functions()) {
+               const FunctionProfile & f = mFunctions[fn];
+               json.object([&] {
+                  json.attribute("name", mProg.functions[fn].name);
+                  json.attribute("line", int64_t(mProg.functions[fn].line));
+                  json.attribute("calls", int64_t(f.calls));
+                  json.attribute("inclusiveNs", int64_t(f.inclusive * ns));
+                  json.attribute("exclusiveNs", int64_t(f.exclusive * ns));
+               });
+            }
+         });
+         json.attributeArray("lines", [&] {
+            for (const LineProfile & p : lines())
+               json.object([&] {
+                  json.attribute("function", mProg.functions[p.fn].name);
+                  json.attribute("line", int64_t(p.line));
+                  json.attribute("executions", int64_t(p.executions));
+                  json.attribute("instructions", int64_t(p.instructions));
+               });
+         });
+      });
+      os << "\n";
+   }
+
+   /// write() to the file at \p path, false if it cannot be written
+   bool write(llvm::StringRef path) const {
+      std::error_code error;
+      llvm::raw_fd_ostream os(path, error, llvm::sys::fs::OF_Text);
+      if (error) return false;
+      write(os);
+      os.close();
+      bool failed = os.has_error();
+      os.clear_error();
+      return !failed;
+   }
+};
+
+#endif
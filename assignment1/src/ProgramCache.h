@@ -0,0 +1,343 @@
+//==--- ProgramCache.h - Lowered programs cached on disk -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PROGRAM_CACHE_H
+#define AST_INTERPRETER_PROGRAM_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "Bytecode.h"
+#include "Memory.h"
+#include "Vector.h"
+
+/// A Program does not refer to the AST it was lowered from, so it can be
+/// written to a file and read back without Clang.  The image is a header,
+/// the source it was compiled from, then for every function a
+/// FunctionHeader, its name, its code, its constants and its line table,
+/// each padded to 8 bytes.  Images are in host byte order: they are a cache, not an
+/// interchange format.
+///
+/// An image is only read back by an interpreter with the same image
+/// version and LLVM, so that any build of the same sources shares the
+/// cache.  kVersion is bumped by every change to the compiler or the
+/// optimizer, so no such change runs bytecode lowered before it.  Reading checks every operand against the function
+/// and the program it belongs to, so a damaged image is a miss rather
+/// than a VM reading out of bounds.
+class ProgramImage {
+public:
+   /// Bump whenever the layout of the image, the meaning of the bytecode
+   /// or the code the compiler and the optimizer emit changes
+   static const uint32_t kVersion = 4;
+
+   /// Identifies the interpreters that lower a source to the same image:
+   /// the image version and the LLVM, whose Clang parses the source
+   static uint64_t build() {
+      static const uint64_t id = llvm::xxHash64(
+         llvm::StringRef("astbc " + std::to_string(kVersion) + " LLVM " LLVM_VERSION_STRING));
+      return id;
+   }
+private:
+   struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t opcodes;       /// OP_COUNT of the writer
+      uint64_t build;
+      uint64_t checksum;      /// of the rest of the header and everything after it
+      uint32_t optimized;
+      uint32_t numFunctions;
+      uint64_t sourceBytes;
+      uint32_t numGlobals;
+      int32_t entry;
+      int32_t globalInit;
+      int32_t pad;
+      int64_t dataBytes;
+   };
+
+   struct FunctionHeader {
+      uint32_t nameBytes;
+      uint32_t numParams;
+      uint32_t numSlots;
+      uint32_t numRegs;
+      int64_t frameBytes;
+      uint32_t codeSize;
+      uint32_t numConsts;
+      uint32_t line;
+      uint32_t numLines;      /// codeSize, or 0 without a line table
+   };
+
+   struct PackedInstr {
+      int32_t op, a, b, c;
+   };
+
+   /// The checksum of an image starting with \p header and followed by
+   /// \p body
+   static uint64_t checksum(Header header, llvm::StringRef body) {
+      header.checksum = llvm::xxHash64(body);
+      return llvm::xxHash64(llvm::StringRef((const char *) &header, sizeof(header)));
+   }
+
+   static const char * magic() {
+      return "ASTIPRG";
+   }
+
+   static uint64_t padded(uint64_t bytes) {
+      return (bytes + 7) & ~uint64_t(7);
+   }
+
+   static void write(llvm::raw_ostream & os, const void * data, uint64_t bytes) {
+      static const char zeros[8] = {0};
+      os.write((const char *) data, bytes);
+      os.write(zeros, padded(bytes) - bytes);
+   }
+
+   /// Reads the image front to back, failing once it runs out of bytes
+   class Reader {
+      const char * mPos;
+      const char * mEnd;
+   public:
+      explicit Reader(llvm::StringRef image) : mPos(image.begin()), mEnd(image.end()) {}
+
+      const char * take(uint64_t bytes) {
+         if (uint64_t(mEnd - mPos) < padded(bytes)) return NULL;
+         const char * data = mPos;
+         mPos += padded(bytes);
+         return data;
+      }
+
+      template <typename T>
+      bool read(T & value) {
+         const char * data = take(sizeof(T));
+         if (data) memcpy(&value, data, sizeof(T));
+         return data;
+      }
+   };
+
+   /// Whether \p val indexes something of \p count
+   static bool in(LL val, LL count) {
+      return val >= 0 && val < count;
+   }
+
+   /// Whether every operand of \p fn names a register, constant, global,
+   /// function or instruction that exists, and its code cannot run past
+   /// its end
+   static bool valid(const Program & prog, const Function & fn) {
+      if (fn.code.empty() || fn.numParams > fn.numSlots || fn.numSlots > fn.numRegs
+          || fn.frameBytes < 0 || fn.frameBytes >= Memory::kReserve)
+         return false;
+      LL regs = fn.numRegs, size = fn.code.size();
+      LL consts = fn.consts.size(), globals = prog.numGlobals;
+      LL functions = prog.functions.size();
+      for (const Instr & I : fn.code) {
+         bool ok;
+         switch (I.op) {
+         case OP_NOP: case OP_RETVOID: ok = true; break;
+         case OP_LOADK: ok = in(I.a, regs) && in(I.b, consts); break;
+         case OP_LOADGLOBAL: ok = in(I.a, regs) && in(I.b, globals); break;
+         case OP_STOREGLOBAL: ok = in(I.a, globals) && in(I.b, regs); break;
+         case OP_FRAMEADDR: case OP_ZERO: case OP_RET: case OP_GET: case OP_PRINT: case OP_FREE:
+            ok = in(I.a, regs);
+            break;
+         case OP_VEC32: {
+            int op = I.c & Vector::kOpMask;
+            ok = in(I.a, regs) && in(I.b, regs) && in(LL(I.b) + 3, regs)
+                 && !(I.c & ~(Vector::kOpMask | Vector::kArrayX | Vector::kArrayY))
+                 && (op == OP_MOV || op == OP_ADD || op == OP_SUB || op == OP_MUL
+                     || op == OP_AND || op == OP_OR || op == OP_XOR);
+            break;
+         }
+         case OP_JMP: ok = in(I.a, size); break;
+         case OP_JZ: case OP_JNZ: ok = in(I.a, regs) && in(I.b, size); break;
+         case OP_ADDK: case OP_MULK: ok = in(I.a, regs) && in(I.b, regs); break;
+         case OP_JLTK: case OP_JGTK: case OP_JLEK: case OP_JGEK: case OP_JEQK: case OP_JNEK:
+            ok = in(I.a, regs) && in(I.c, size);
+            break;
+         case OP_JLT: case OP_JGT: case OP_JLE: case OP_JGE: case OP_JEQ: case OP_JNE:
+            ok = in(I.a, regs) && in(I.b, regs) && in(I.c, size);
+            break;
+         case OP_CALL:
+            /// The arguments are the registers the callee's frame starts at
+            ok = in(I.a, regs) && in(I.b, functions) && I.c >= 0
+                 && I.c + LL(prog.functions[I.b].numParams) <= regs;
+            break;
+         default:
+            /// Unary operators, loads, stores and MALLOC take two
+            /// registers, binary operators three
+            ok = in(I.a, regs) && in(I.b, regs)
+                 && (I.op < OP_ADD || I.op > OP_NE || in(I.c, regs));
+            break;
+         }
+         if (!ok) return false;
+      }
+      Opcode last = fn.code.back().op;
+      return last == OP_RET || last == OP_RETVOID || last == OP_JMP;
+   }
+public:
+   static void write(llvm::raw_ostream & os, const Program & prog,
+                     llvm::StringRef source, bool optimized) {
+      Header header;
+      memset(&header, 0, sizeof(header));
+      strcpy(header.magic, magic());
+      header.version = kVersion;
+      header.opcodes = OP_COUNT;
+      header.build = build();
+      header.optimized = optimized;
+      header.numFunctions = prog.functions.size();
+      header.sourceBytes = source.size();
+      header.numGlobals = prog.numGlobals;
+      header.entry = prog.entry;
+      header.globalInit = prog.globalInit;
+      header.dataBytes = prog.dataBytes;
+      std::string image;
+      llvm::raw_string_ostream body(image);
+      write(body, source.data(), source.size());
+      for (const Function & fn : prog.functions) {
+         FunctionHeader fh;
+         memset(&fh, 0, sizeof(fh));
+         fh.nameBytes = fn.name.size();
+         fh.numParams = fn.numParams;
+         fh.numSlots = fn.numSlots;
+         fh.numRegs = fn.numRegs;
+         fh.frameBytes = fn.frameBytes;
+         fh.codeSize = fn.code.size();
+         fh.numConsts = fn.consts.size();
+         fh.line = fn.line;
+         fh.numLines = fn.lines.size();
+         write(body, &fh, sizeof(fh));
+         write(body, fn.name.data(), fn.name.size());
+         std::vector<PackedInstr> code;
+         code.reserve(fn.code.size());
+         for (const Instr & I : fn.code)
+            code.push_back(PackedInstr{I.op, I.a, I.b, I.c});
+         write(body, code.data(), code.size() * sizeof(PackedInstr));
+         write(body, fn.consts.data(), fn.consts.size() * sizeof(LL));
+         write(body, fn.lines.data(), fn.lines.size() * sizeof(uint32_t));
+      }
+      body.flush();
+      header.checksum = checksum(header, image);
+      write(os, &header, sizeof(header));
+      os << image;
+   }
+
+   /// Rebuild \p prog from \p image, false if the image is damaged, from
+   /// another version or was compiled from anything but \p source
+   static bool read(llvm::StringRef image, llvm::StringRef source, bool optimized,
+                    Program & prog) {
+      Reader reader(image);
+      Header header;
+      if (!reader.read(header) || strncmp(header.magic, magic(), sizeof(header.magic))
+          || header.version != kVersion || header.opcodes != OP_COUNT || header.build != build()
+          || header.optimized != optimized || header.sourceBytes != source.size()
+          || header.checksum != checksum(header, image.drop_front(padded(sizeof(header)))))
+         return false;
+      const char * text = reader.take(header.sourceBytes);
+      if (!text || llvm::StringRef(text, header.sourceBytes) != source) return false;
+
+      /// Every function, global and variable has a declaration in the
+      /// source, and no instruction names more than four temporaries
+      if (header.numFunctions > source.size() || header.numGlobals > source.size())
+         return false;
+      Program loaded;
+      loaded.functions.resize(header.numFunctions);
+      loaded.numGlobals = header.numGlobals;
+      loaded.dataBytes = header.dataBytes;
+      loaded.entry = header.entry;
+      loaded.globalInit = header.globalInit;
+      for (Function & fn : loaded.functions) {
+         FunctionHeader fh;
+         if (!reader.read(fh)) return false;
+         const char * name = reader.take(fh.nameBytes);
+         const char * code = reader.take(uint64_t(fh.codeSize) * sizeof(PackedInstr));
+         const char * consts = reader.take(uint64_t(fh.numConsts) * sizeof(LL));
+         if (fh.numLines && fh.numLines != fh.codeSize) return false;
+         const char * lines = reader.take(uint64_t(fh.numLines) * sizeof(uint32_t));
+         if (!name || !code || !consts || !lines || fh.numSlots > source.size()
+             || fh.numRegs > fh.numSlots + 4 * uint64_t(fh.codeSize))
+            return false;
+         fn.name.assign(name, fh.nameBytes);
+         fn.numParams = fh.numParams;
+         fn.numSlots = fh.numSlots;
+         fn.numRegs = fh.numRegs;
+         fn.frameBytes = fh.frameBytes;
+         fn.line = fh.line;
+         fn.code.reserve(fh.codeSize);
+         for (uint32_t pc = 0; pc < fh.codeSize; ++pc) {
+            PackedInstr I;
+            memcpy(&I, code + pc * sizeof(PackedInstr), sizeof(I));
+            if (I.op < 0 || I.op >= OP_COUNT) return false;
+            fn.code.push_back(Instr(Opcode(I.op), I.a, I.b, I.c));
+         }
+         fn.consts.resize(fh.numConsts);
+         memcpy(fn.consts.data(), consts, fh.numConsts * sizeof(LL));
+         fn.lines.resize(fh.numLines);
+         memcpy(fn.lines.data(), lines, fh.numLines * sizeof(uint32_t));
+      }
+      int count = loaded.functions.size();
+      if (loaded.entry < 0 || loaded.entry >= count
+          || loaded.globalInit < 0 || loaded.globalInit >= count
+          || loaded.dataBytes < 0 || loaded.dataBytes >= Memory::kReserve)
+         return false;
+      for (const Function & fn : loaded.functions)
+         if (!valid(loaded, fn)) return false;
+      prog = std::move(loaded);
+      return true;
+   }
+};
+
+/// A directory of program images named after a hash of their source, of
+/// the options they were compiled with and of ProgramImage::build().  Images are written to a
+/// temporary file and renamed into place, so concurrent interpreters never
+/// see half an image, and one that cannot be read is a miss.
+class ProgramCache {
+   std::string mDir;
+
+   std::string path(llvm::StringRef source, bool optimized) const {
+      llvm::SmallString<128> file(mDir);
+      llvm::sys::path::append(file, llvm::utohexstr(llvm::xxHash64(source) ^ ProgramImage::build())
+                                    + (optimized ? ".O1" : ".O0") + ".astbc");
+      return file.str().str();
+   }
+public:
+   explicit ProgramCache(llvm::StringRef dir) : mDir(dir.str()) {}
+
+   /// The program compiled from \p source, false on a miss
+   bool load(llvm::StringRef source, bool optimized, Program & prog) const {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> image =
+         llvm::MemoryBuffer::getFile(path(source, optimized), -1, false);
+      return image && ProgramImage::read((*image)->getBuffer(), source, optimized, prog);
+   }
+
+   /// Remember \p prog as compiled from \p source, quietly giving up if the
+   /// directory cannot be written
+   void store(llvm::StringRef source, bool optimized, const Program & prog) const {
+      if (llvm::sys::fs::create_directories(mDir)) return;
+      llvm::SmallString<128> model(mDir), temp;
+      llvm::sys::path::append(model, "image-%%%%%%%%.tmp");
+      int fd;
+      if (llvm::sys::fs::createUniqueFile(model, fd, temp)) return;
+      bool failed;
+      {
+         llvm::raw_fd_ostream os(fd, true);
+         ProgramImage::write(os, prog, source, optimized);
+         os.close();
+         failed = os.has_error();
+         os.clear_error();
+      }
+      if (failed || llvm::sys::fs::rename(temp, path(source, optimized)))
+         llvm::sys::fs::remove(temp);
+   }
+};
+
+#endif
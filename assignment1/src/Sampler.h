@@ -0,0 +1,256 @@
+//==--- Sampler.h - Sampling the interpreted call stack --------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SAMPLER_H
+#define AST_INTERPRETER_SAMPLER_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/// Samples where a VM spends its CPU time.  A timer on the CPU clock of
+/// the thread running the program raises SIGPROF on that same thread, and
+/// the handler copies the call stack the VM keeps for the sampler into a
+/// ring buffer.  The VM updates that stack with plain stores, which the
+/// handler, interrupting the same thread, always sees complete.  The ring
+/// is drained into folded stacks by the VM itself whenever it enters a
+/// call and the ring is half full, and once more when sampling stops; a
+/// sample that finds the ring full is dropped and counted.
+///
+/// A frame is a function and the instruction it is at, or a function
+/// running native code, which has no instruction.  Frames deeper than
+/// kMaxFrames are not recorded and a sample of such a stack ends in
+/// "[deeper]".  One sampled VM may run per thread at a time.
+class Sampler {
+public:
+   static const unsigned kDefaultRate = 1000;
+
+   /// A frame of the sampled stack
+   struct Frame {
+      int fn;
+      const Instr * volatile pc;      /// NULL in native code
+   };
+private:
+   static const unsigned kMaxFrames = 1024;
+   static const size_t kRingWords = size_t(1) << 20;
+
+   const Program & mProg;
+   unsigned mRate;
+   Frame mFrames[kMaxFrames + 1];       /// the last one takes what is deeper
+   volatile unsigned mDepth;
+   std::unique_ptr<uint64_t[]> mRing;   /// depth, then fn and pc per frame
+   std::atomic<size_t> mHead;
+   std::atomic<size_t> mTail;
+   volatile bool mDue;                  /// the ring is half full
+   volatile uint64_t mSamples;
+   volatile uint64_t mDropped;
+   std::map<std::vector<uint64_t>, uint64_t> mStacks;   /// samples by stack
+   timer_t mTimer;
+   bool mRunning;
+   Sampler * mOuter;                    /// sampled on this thread before
+
+   static Sampler *& active() {
+      static thread_local Sampler * sampler = NULL;
+      return sampler;
+   }
+
+   static void handle(int) {
+      if (Sampler * sampler = active()) sampler->sample();
+   }
+
+   /// Runs in the signal handler
+   void sample() {
+      unsigned depth = mDepth;
+      unsigned frames = depth < kMaxFrames ? depth : kMaxFrames;
+      size_t words = 1 + 2 * size_t(frames);
+      size_t head = mHead.load(std::memory_order_relaxed);
+      size_t used = head - mTail.load(std::memory_order_acquire);
+      ++mSamples;
+      if (used + words > kRingWords) {
+         ++mDropped;
+         mDue = true;
+         return;
+      }
+      mRing[head++ & (kRingWords - 1)] = depth;
+      for (unsigned i = 0; i < frames; ++i) {
+         mRing[head++ & (kRingWords - 1)] = (uint64_t) mFrames[i].fn;
+         mRing[head++ & (kRingWords - 1)] = (uint64_t) (uintptr_t) mFrames[i].pc;
+      }
+      mHead.store(head, std::memory_order_release);
+      if (used + words > kRingWords / 2) mDue = true;
+   }
+
+   /// Move the samples in the ring to mStacks, a stack as a fn and a line
+   /// per frame from the root, 0 for native code and ~0 for "[deeper]"
+   void drain() {
+      mDue = false;
+      size_t head = mHead.load(std::memory_order_acquire);
+      size_t tail = mTail.load(std::memory_order_relaxed);
+      std::vector<uint64_t> stack;
+      while (tail != head) {
+         uint64_t depth = mRing[tail++ & (kRingWords - 1)];
+         unsigned frames = depth < kMaxFrames ? depth : kMaxFrames;
+         stack.clear();
+         for (unsigned i = 0; i < frames; ++i) {
+            int fn = (int) mRing[tail++ & (kRingWords - 1)];
+            const Instr * pc = (const Instr *) (uintptr_t) mRing[tail++ & (kRingWords - 1)];
+            const Function & f = mProg.functions[fn];
+            size_t at = pc ? pc - f.code.data() : 0;
+            unsigned line = pc ? (at < f.lines.size() ? f.lines[at] : 0) + 1 : 0;
+            stack.push_back((uint64_t) fn << 32 | line);
+         }
+         if (depth > kMaxFrames) stack.push_back(~uint64_t(0));
+         ++mStacks[stack];
+      }
+      mTail.store(tail, std::memory_order_release);
+   }
+public:
+   /// A sampler taking \p rate samples per second of CPU time
+   Sampler(const Program & prog, unsigned rate)
+      : mProg(prog), mRate(rate ? rate : kDefaultRate), mFrames(), mDepth(0),
+        mRing(new uint64_t[kRingWords]), mHead(0), mTail(0), mDue(false), mSamples(0),
+        mDropped(0), mStacks(), mTimer(), mRunning(false), mOuter(NULL) {}
+
+   ~Sampler() {
+      stop();
+   }
+
+   Sampler(const Sampler &) = delete;
+   Sampler & operator=(const Sampler &) = delete;
+
+   /// Start sampling the calling thread, false with errno set if no timer
+   /// is available or it cannot be armed
+   bool start() {
+      static std::once_flag installed;
+      std::call_once(installed, [] {
+         struct sigaction action;
+         memset(&action, 0, sizeof(action));
+         action.sa_handler = handle;
+         action.sa_flags = SA_RESTART;
+         sigemptyset(&action.sa_mask);
+         sigaction(SIGPROF, &action, NULL);
+      });
+      struct sigevent event;
+      memset(&event, 0, sizeof(event));
+      event.sigev_notify = SIGEV_THREAD_ID;
+      event.sigev_signo = SIGPROF;
+      event.sigev_notify_thread_id = syscall(SYS_gettid);
+      if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &mTimer)) return false;
+      /// tv_nsec has to stay below a second, so a rate of 1 is tv_sec 1
+      long long period = 1000000000LL / mRate;
+      if (!period) period = 1;
+      struct itimerspec interval;
+      interval.it_interval.tv_sec = period / 1000000000LL;
+      interval.it_interval.tv_nsec = period % 1000000000LL;
+      interval.it_value = interval.it_interval;
+      Sampler * outer = active();
+      active() = this;
+      if (timer_settime(mTimer, 0, &interval, NULL)) {
+         int error = errno;
+         timer_delete(mTimer);
+         active() = outer;
+         errno = error;
+         return false;
+      }
+      mOuter = outer;
+      mRunning = true;
+      return true;
+   }
+
+   /// Stop sampling and collect what is left in the ring
+   void stop() {
+      if (!mRunning) return;
+      timer_delete(mTimer);
+      active() = mOuter;
+      mRunning = false;
+      drain();
+   }
+
+   /// Enter a call of \p fn at \p pc and return where the VM keeps its
+   /// instruction
+   const Instr * volatile * push(int fn, const Instr * pc) {
+      if (mDue) drain();
+      unsigned depth = mDepth;
+      Frame & frame = mFrames[depth < kMaxFrames ? depth : kMaxFrames];
+      frame.fn = fn;
+      frame.pc = pc;
+      std::atomic_signal_fence(std::memory_order_release);
+      mDepth = depth + 1;
+      return &frame.pc;
+   }
+
+   /// Leave the innermost call and return where the VM keeps the
+   /// instruction of its caller
+   const Instr * volatile * pop() {
+      unsigned depth = mDepth - 1;
+      mDepth = depth;
+      std::atomic_signal_fence(std::memory_order_release);
+      if (!depth) return &mFrames[kMaxFrames].pc;
+      return &mFrames[depth - 1 < kMaxFrames ? depth - 1 : kMaxFrames].pc;
+   }
+
+   uint64_t samples() const {
+      return mSamples;
+   }
+
+   uint64_t dropped() const {
+      return mDropped;
+   }
+
+   /// Write the samples as folded stacks, one "frame;frame;... count" line
+   /// per stack from the root, which flame graph tools read.  A frame is
+   /// "function:line", or "function [native]" in native code.
+   void write(llvm::raw_ostream & os) const {
+      for (const std::pair<const std::vector<uint64_t>, uint64_t> & stack : mStacks) {
+         const char * separator = "";
+         for (uint64_t frame : stack.first) {
+            os << separator;
+            separator = ";";
+            if (frame == ~uint64_t(0)) {
+               os << "[deeper]";
+               continue;
+            }
+            unsigned line = (unsigned) frame;
+            os << mProg.functions[frame >> 32].name;
+            if (line) os << ':' << line - 1;
+            else os << " [native]";
+         }
+         os << ' ' << stack.second << '\n';
+      }
+   }
+
+   /// write() to the file at \p path, false if it cannot be written
+   bool write(llvm::StringRef path) const {
+      std::error_code error;
+      llvm::raw_fd_ostream os(path, error, llvm::sys::fs::OF_Text);
+      if (error) return false;
+      write(os);
+      os.close();
+      bool failed = os.has_error();
+      os.clear_error();
+      return !failed;
+   }
+};
+
+#endif
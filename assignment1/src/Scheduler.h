@@ -0,0 +1,252 @@
+//==--- Scheduler.h - Executions interleaved on one thread -----------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SCHEDULER_H
+#define AST_INTERPRETER_SCHEDULER_H
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "IO.h"
+#include "VM.h"
+
+class Scheduler;
+
+/// A function running on a stack of its own that can stop in the middle
+/// and be continued later.  resume() runs it until it calls suspend() or
+/// returns.  The stack is reserved, not committed, so a deep one is cheap.
+class Coroutine {
+   ucontext_t mContext;
+   ucontext_t mCaller;
+   char * mStack;
+   size_t mStackBytes;
+   std::function<void()> mBody;
+   bool mDone;
+
+   static Coroutine *& current() {
+      static thread_local Coroutine * running = NULL;
+      return running;
+   }
+
+   /// makecontext passes int arguments only, so this gets split in two
+   static void start(unsigned lo, unsigned hi) {
+      Coroutine * self = (Coroutine *) (((uintptr_t) hi << 32) | lo);
+      self->mBody();
+      self->mDone = true;
+      swapcontext(&self->mContext, &self->mCaller);
+   }
+public:
+   Coroutine(std::function<void()> body, size_t stackBytes)
+      : mContext(), mCaller(), mStack(NULL), mStackBytes(stackBytes),
+        mBody(std::move(body)), mDone(false) {
+      void * stack = mmap(NULL, mStackBytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (stack == MAP_FAILED)
+         llvm::report_fatal_error("cannot reserve a coroutine stack");
+      mStack = (char *) stack;
+      mprotect(mStack, Memory::kPageSize, PROT_NONE);
+      getcontext(&mContext);
+      mContext.uc_stack.ss_sp = mStack;
+      mContext.uc_stack.ss_size = mStackBytes;
+      mContext.uc_link = NULL;
+      uintptr_t self = (uintptr_t) this;
+      makecontext(&mContext, (void (*)()) start, 2, (unsigned) self, (unsigned) (self >> 32));
+   }
+
+   /// Dropping a coroutine that has not finished abandons its stack, so
+   /// nothing on it may need destroying
+   ~Coroutine() {
+      munmap(mStack, mStackBytes);
+   }
+
+   Coroutine(const Coroutine &) = delete;
+   Coroutine & operator=(const Coroutine &) = delete;
+
+   void resume() {
+      assert(!mDone && "coroutine has finished");
+      Coroutine * outer = current();
+      current() = this;
+      swapcontext(&mCaller, &mContext);
+      current() = outer;
+   }
+
+   /// Stop the running coroutine, resume() continues after the call
+   static void suspend() {
+      Coroutine * self = current();
+      assert(self && "not in a coroutine");
+      swapcontext(&self->mContext, &self->mCaller);
+   }
+
+   /// The coroutine this thread is running, NULL outside of one
+   static Coroutine * running() {
+      return current();
+   }
+
+   bool done() const {
+      return mDone;
+   }
+};
+
+/// Input arriving while an execution of a Scheduler runs.  A GET that
+/// finds the channel empty suspends the execution until push() or close()
+/// is called; after close() the remaining input is read and GET then
+/// sees the end of the input as usual.
+class Channel : public Input {
+   friend class Scheduler;
+
+   Scheduler * mScheduler;    /// of the execution reading the channel
+   void * mExecution;
+   bool mWaiting;             /// the execution is suspended in GET
+   std::string mPending;      /// pushed but not handed to the reader yet
+   std::string mReading;      /// the bytes the reader is at
+   bool mClosed;
+
+   void wake();
+protected:
+   virtual size_t fill(const char *& data) {
+      while (mPending.empty() && !mClosed) {
+         if (!Coroutine::running() || !mScheduler)
+            llvm::report_fatal_error("GET on an empty channel outside of a scheduled execution");
+         mWaiting = true;
+         Coroutine::suspend();
+      }
+      mReading.swap(mPending);
+      mPending.clear();
+      data = mReading.data();
+      return mReading.size();
+   }
+public:
+   Channel() : mScheduler(NULL), mExecution(NULL), mWaiting(false), mPending(), mReading(),
+               mClosed(false) {}
+
+   void push(llvm::StringRef data) {
+      mPending.append(data.begin(), data.end());
+      wake();
+   }
+
+   void close() {
+      mClosed = true;
+      wake();
+   }
+};
+
+/// Runs many executions as coroutines on the calling thread.  An execution
+/// runs until it finishes or blocks on its Channel, then the next ready
+/// one runs.  Pushing input to a blocked execution's channel makes it
+/// ready again.  Every execution has its own VM and so must not share a
+/// Program that is still lowered on demand with executions on other
+/// threads.  Executions are not sampled, since a Sampler belongs to the
+/// thread and the executions take turns on it.
+///
+/// Every execution reserves VMOptions::memoryBytes of address space for
+/// the memory of its VM, 4GB unless set lower, and three times as much
+/// with guard pages.  Thousands of executions need it set lower, or they
+/// run out of address space or into the overcommit limit.  With the JIT, native code recurses on
+/// the stack of the execution, so each also reserves VM::kNativeStackBytes
+/// for it.  Only the first kMaxNativeExecutions executions running at a
+/// time get the JIT; the others are interpreted on a small stack.
+class Scheduler {
+   friend class Channel;
+public:
+   /// Executions that may run with the JIT at a time
+   static const size_t kMaxNativeExecutions = 256;
+private:
+   /// Stack of an execution without the JIT, which only recurses for a
+   /// few frames
+   static const size_t kInterpreterStackBytes = size_t(8) << 20;
+
+   struct Execution {
+      std::unique_ptr<VM> vm;
+      std::unique_ptr<Coroutine> coroutine;
+      Channel * input;
+      bool native;
+      std::list<Execution>::iterator self;
+   };
+
+   std::list<Execution> mExecutions;
+   std::deque<Execution *> mReady;
+   unsigned mSuspensions;
+   size_t mNative;            /// executions running with the JIT
+
+   void ready(void * execution) {
+      mReady.push_back((Execution *) execution);
+   }
+public:
+   Scheduler() : mExecutions(), mReady(), mSuspensions(0), mNative(0) {}
+
+   ~Scheduler() {
+      for (Execution & e : mExecutions)
+         e.input->mScheduler = NULL;
+   }
+
+   Scheduler(const Scheduler &) = delete;
+   Scheduler & operator=(const Scheduler &) = delete;
+
+   /// Start running \p prog with GET reading \p in and PRINT writing
+   /// \p out the next time run() is called.  Both have to outlive the
+   /// execution.
+   void spawn(const Program & prog, const VMOptions & options, Channel & in,
+              llvm::raw_ostream & out) {
+      assert(!in.mScheduler && "channel belongs to another execution");
+      mExecutions.push_back(Execution());
+      Execution & e = mExecutions.back();
+      e.self = --mExecutions.end();
+      e.input = &in;
+      VMOptions scheduled = options;
+      scheduled.sampleRate = 0;
+      scheduled.jit = options.jit && mNative < kMaxNativeExecutions;
+      e.native = scheduled.jit;
+      if (e.native) ++mNative;
+      e.vm.reset(new VM(prog, scheduled, in, out));
+      VM * vm = e.vm.get();
+      e.coroutine.reset(new Coroutine([vm] { vm->runInPlace(); },
+         e.native ? VM::kNativeStackBytes : kInterpreterStackBytes));
+      in.mScheduler = this;
+      in.mExecution = &e;
+      mReady.push_back(&e);
+   }
+
+   /// Run executions until all have finished or are waiting for input
+   void run() {
+      while (!mReady.empty()) {
+         Execution * e = mReady.front();
+         mReady.pop_front();
+         e->coroutine->resume();
+         if (e->coroutine->done()) {
+            e->input->mScheduler = NULL;
+            if (e->native) --mNative;
+            mExecutions.erase(e->self);
+         } else {
+            ++mSuspensions;
+         }
+      }
+   }
+
+   /// Executions that have not finished
+   size_t size() const {
+      return mExecutions.size();
+   }
+
+   /// How often an execution had to wait for input
+   unsigned suspensions() const {
+      return mSuspensions;
+   }
+};
+
+inline void Channel::wake() {
+   if (!mWaiting || !mScheduler) return;
+   mWaiting = false;
+   mScheduler->ready(mExecution);
+}
+
+#endif
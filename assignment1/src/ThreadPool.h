@@ -0,0 +1,81 @@
+//==--- ThreadPool.h - Workers running independent executions --------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_THREAD_POOL_H
+#define AST_INTERPRETER_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed set of threads taking tasks from one queue.  Tasks must not
+/// share mutable state; an execution is a VM of its own over a complete
+/// Program, which is read only.
+class ThreadPool {
+   std::vector<std::thread> mWorkers;
+   std::deque<std::function<void()>> mTasks;
+   std::mutex mLock;
+   std::condition_variable mWork;      /// a task was queued or the pool stops
+   std::condition_variable mIdle;      /// the last running task finished
+   unsigned mRunning;
+   bool mStopping;
+
+   void work() {
+      std::unique_lock<std::mutex> lock(mLock);
+      for (;;) {
+         mWork.wait(lock, [this] { return mStopping || !mTasks.empty(); });
+         if (mTasks.empty()) return;
+         std::function<void()> task = std::move(mTasks.front());
+         mTasks.pop_front();
+         ++mRunning;
+         lock.unlock();
+         task();
+         lock.lock();
+         if (!--mRunning && mTasks.empty()) mIdle.notify_all();
+      }
+   }
+public:
+   /// A pool of \p threads workers, one per core if 0
+   explicit ThreadPool(unsigned threads = 0)
+      : mWorkers(), mTasks(), mLock(), mWork(), mIdle(), mRunning(0), mStopping(false) {
+      if (!threads) threads = std::thread::hardware_concurrency();
+      if (!threads) threads = 1;
+      for (unsigned i = 0; i < threads; ++i)
+         mWorkers.emplace_back(&ThreadPool::work, this);
+   }
+
+   ThreadPool(const ThreadPool &) = delete;
+   ThreadPool & operator=(const ThreadPool &) = delete;
+
+   ~ThreadPool() {
+      {
+         std::lock_guard<std::mutex> lock(mLock);
+         mStopping = true;
+      }
+      mWork.notify_all();
+      for (std::thread & worker : mWorkers)
+         worker.join();
+   }
+
+   void submit(std::function<void()> task) {
+      {
+         std::lock_guard<std::mutex> lock(mLock);
+         mTasks.push_back(std::move(task));
+      }
+      mWork.notify_one();
+   }
+
+   /// Block until every task submitted so far has finished
+   void wait() {
+      std::unique_lock<std::mutex> lock(mLock);
+      mIdle.wait(lock, [this] { return !mRunning && mTasks.empty(); });
+   }
+
+   unsigned size() const {
+      return mWorkers.size();
+   }
+};
+
+#endif
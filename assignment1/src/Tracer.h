@@ -0,0 +1,243 @@
+//==--- Tracer.h - Timeline of calls, loops, memory and IO ------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_TRACER_H
+#define AST_INTERPRETER_TRACER_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+#include "Clock.h"
+
+/// Records what the running programs do as fixed-size events in a ring
+/// buffer per thread, so recording takes a timestamp and a few stores and
+/// never a lock.  A ring keeps the last kEvents events of its thread; a
+/// long run overwrites its oldest ones.  The trace is written as Chrome
+/// trace event JSON, which chrome://tracing and Perfetto show as a
+/// timeline, by write() or, while the program runs, on SIGUSR1: the next
+/// event recorded after the signal writes it.
+///
+/// There is one Tracer per process, which records nothing until it is
+/// enabled.  The VM and the Environment only call it while it is.
+class Tracer {
+public:
+   enum Kind : uint32_t { Enter, Exit, Loop, Get, Print, Malloc, Free };
+
+   /// Events a thread keeps, a power of two
+   static const size_t kEvents = size_t(1) << 18;
+private:
+   struct Event {
+      uint64_t ticks;
+      Kind kind;
+      uint32_t pc;            /// loop header
+      LL a;                   /// value, address or size
+      LL b;                   /// Function or size
+   };
+
+   /// The events of one thread.  Only that thread writes them; head
+   /// counts the events ever recorded.
+   struct Ring {
+      std::unique_ptr<Event[]> events;
+      std::atomic<uint64_t> head;
+      long tid;
+   };
+
+   std::mutex mLock;
+   std::vector<std::unique_ptr<Ring>> mRings;
+   std::atomic<bool> mEnabled;
+   std::atomic<bool> mDumpRequested;
+   std::string mFile;
+   Clock mClock;
+
+   Tracer() : mLock(), mRings(), mEnabled(false), mDumpRequested(false), mFile(), mClock() {}
+
+   static void requestDump(int) {
+      instance().mDumpRequested.store(true, std::memory_order_relaxed);
+   }
+
+   Ring & ring() {
+      static thread_local Ring * local = NULL;
+      if (!local) {
+         std::unique_ptr<Ring> ring(new Ring());
+         ring->events.reset(new Event[kEvents]);
+         ring->head.store(0, std::memory_order_relaxed);
+         ring->tid = syscall(SYS_gettid);
+         local = ring.get();
+         std::lock_guard<std::mutex> lock(mLock);
+         mRings.push_back(std::move(ring));
+      }
+      return *local;
+   }
+
+   void record(Kind kind, uint32_t pc, LL a, LL b) {
+      if (mDumpRequested.load(std::memory_order_relaxed) &&
+          mDumpRequested.exchange(false) && !mFile.empty())
+         write(mFile);
+      Ring & r = ring();
+      uint64_t head = r.head.load(std::memory_order_relaxed);
+      Event & e = r.events[head & (kEvents - 1)];
+      e.ticks = Clock::ticks();
+      e.kind = kind;
+      e.pc = pc;
+      e.a = a;
+      e.b = b;
+      r.head.store(head + 1, std::memory_order_release);
+   }
+
+   /// The events of \p r still in the ring, oldest first.  A thread may
+   /// be recording meanwhile, so what it overwrote while they were copied
+   /// is dropped.
+   static std::vector<Event> events(const Ring & r) {
+      uint64_t head = r.head.load(std::memory_order_acquire);
+      uint64_t first = head > kEvents ? head - kEvents : 0;
+      std::vector<Event> copy;
+      copy.reserve(head - first);
+      for (uint64_t at = first; at < head; ++at)
+         copy.push_back(r.events[at & (kEvents - 1)]);
+      uint64_t now = r.head.load(std::memory_order_acquire);
+      uint64_t valid = now >= kEvents ? now - kEvents + 1 : 0;
+      if (valid > first) copy.erase(copy.begin(), copy.begin() + std::min(valid - first, head - first));
+      return copy;
+   }
+
+   static const char * name(Kind kind) {
+      switch (kind) {
+      case Get: return "GET";
+      case Print: return "PRINT";
+      case Malloc: return "MALLOC";
+      case Free: return "FREE";
+      default: return "";
+      }
+   }
+public:
+   static Tracer & instance() {
+      static Tracer tracer;
+      return tracer;
+   }
+
+   /// Start recording, and write the trace to \p file on SIGUSR1 if it is
+   /// not empty
+   void enable(llvm::StringRef file) {
+      mFile = file.str();
+      if (!mFile.empty()) {
+         struct sigaction action;
+         memset(&action, 0, sizeof(action));
+         action.sa_handler = requestDump;
+         action.sa_flags = SA_RESTART;
+         sigemptyset(&action.sa_mask);
+         sigaction(SIGUSR1, &action, NULL);
+      }
+      mEnabled.store(true);
+   }
+
+   bool enabled() const {
+      return mEnabled.load(std::memory_order_relaxed);
+   }
+
+   void enter(const Function * fn) {
+      record(Enter, 0, 0, (LL) (uintptr_t) fn);
+   }
+
+   void leave(const Function * fn) {
+      record(Exit, 0, 0, (LL) (uintptr_t) fn);
+   }
+
+   /// An iteration of the loop of \p fn starting at \p header
+   void loop(const Function * fn, int header) {
+      record(Loop, header, 0, (LL) (uintptr_t) fn);
+   }
+
+   void input(LL val) {
+      record(Get, 0, val, 0);
+   }
+
+   void output(LL val) {
+      record(Print, 0, val, 0);
+   }
+
+   void allocate(LL addr, LL size) {
+      record(Malloc, 0, addr, size);
+   }
+
+   void deallocate(LL addr) {
+      record(Free, 0, addr, 0);
+   }
+
+   /// Write the events of every thread as Chrome trace event JSON.  Calls
+   /// are duration events, everything else instant events of the thread.
+   /// The Functions of the events must still exist.
+   void write(llvm::raw_ostream & os) {
+      std::lock_guard<std::mutex> lock(mLock);
+      double us = mClock.nsPerTick() / 1e3;
+      long pid = getpid();
+      llvm::json::OStream json(os);
+      json.object([&] {
+         json.attribute("displayTimeUnit", "ns");
+         json.attributeArray("traceEvents", [&] {
+            for (const std::unique_ptr<Ring> & r : mRings) {
+               for (const Event & e : events(*r)) {
+                  const Function * fn = (const Function *) (uintptr_t) e.b;
+                  json.object([&] {
+                     if (e.kind == Enter || e.kind == Exit) {
+                        json.attribute("name", fn->name);
+                        json.attribute("ph", e.kind == Enter ? "B" : "E");
+                     } else if (e.kind == Loop) {
+                        json.attribute("name", "loop " + fn->name + "@" + std::to_string(e.pc));
+                        json.attribute("ph", "i");
+                        json.attribute("s", "t");
+                     } else {
+                        json.attribute("name", name(e.kind));
+                        json.attribute("ph", "i");
+                        json.attribute("s", "t");
+                        json.attributeObject("args", [&] {
+                           if (e.kind == Malloc) {
+                              json.attribute("address", int64_t(e.a));
+                              json.attribute("bytes", int64_t(e.b));
+                           } else if (e.kind == Free) {
+                              json.attribute("address", int64_t(e.a));
+                           } else {
+                              json.attribute("value", int64_t(e.a));
+                           }
+                        });
+                     }
+                     json.attribute("ts", mClock.since(e.ticks) * us);
+                     json.attribute("pid", int64_t(pid));
+                     json.attribute("tid", int64_t(r->tid));
+                  });
+               }
+            }
+         });
+      });
+      os << "\n";
+   }
+
+   /// write() to the file at \p path, false if it cannot be written
+   bool write(llvm::StringRef path) {
+      std::error_code error;
+      llvm::raw_fd_ostream os(path, error, llvm::sys::fs::OF_Text);
+      if (error) return false;
+      write(os);
+      os.close();
+      bool failed = os.has_error();
+      os.clear_error();
+      return !failed;
+   }
+};
+
+#endif
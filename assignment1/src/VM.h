@@ -0,0 +1,572 @@
+//==--- VM.h - Bytecode interpreter loop -----------------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_VM_H
+#define AST_INTERPRETER_VM_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "Bytecode.h"
+#include "Environment.h"
+#include "Guard.h"
+#include "JIT.h"
+#include "Memo.h"
+#include "Profiler.h"
+#include "Sampler.h"
+#include "Vector.h"
+
+/// How a VM runs its program
+struct VMOptions {
+   static const unsigned kDefaultMaxDepth = 1u << 20;
+   static const unsigned kDefaultJitThreshold = 1000;
+
+   unsigned maxDepth;        /// calls deeper than this are fatal
+   bool jit;                 /// compile hot functions to native code
+   unsigned jitThreshold;    /// calls plus loop iterations that make a function hot
+   bool prompt;              /// GET asks for its input
+   bool memoize;             /// reuse the results of pure functions
+   unsigned memoEntries;     /// results remembered at most
+   bool memoStats;           /// report memo hits and misses after the run
+   bool heapStats;           /// report what MALLOC and FREE did after the run
+   bool guard;               /// invalid memory accesses are errors of the program
+   LL memoryBytes;           /// address space reserved for the program's memory
+   bool profile;             /// report calls, time and lines after the run
+   std::string profileFile;  /// where the profile goes as JSON, if anywhere
+   unsigned sampleRate;      /// call stack samples per second of CPU time, 0 for none
+   std::string sampleFile;   /// where the samples go as folded stacks
+
+   VMOptions() : maxDepth(kDefaultMaxDepth), jit(true), jitThreshold(kDefaultJitThreshold),
+                 prompt(true), memoize(false), memoEntries(MemoTable::kDefaultEntries),
+                 memoStats(false), heapStats(false), guard(false), memoryBytes(Memory::kReserve),
+                 profile(false), profileFile(), sampleRate(0), sampleFile() {}
+};
+
+/// Executes a lowered Program.  Each call gets one flat frame holding its
+/// variables and temporaries and, if it has arrays or address-taken
+/// variables, a data frame in Memory.  The globals live in one area of the
+/// Environment.
+///
+/// Calls do not recurse on the native stack: register frames are windows
+/// of one register stack and the VM keeps its own stack of CallFrames, so
+/// the recursion depth is bounded by maxDepth and the size of Memory, not
+/// by the host's stack limit.  A callee's window starts at the registers
+/// its caller evaluated the arguments into, so arguments are passed in
+/// place.  Both stacks are sized for the program up front and only ever
+/// grow, so once a depth has been reached calls to it allocate nothing.
+///
+/// The VM counts the calls and loop iterations of every function.  Once a
+/// function is hot the JIT compiles it and later calls run native code,
+/// while cold code stays interpreted.  Loop iterations count as well, and
+/// a hot function that is still interpreted is moved into native code at
+/// its next loop back-edge: the loop is compiled on its own, takes over
+/// the registers of the frame and hands them back when control leaves it.
+/// Compiled code recurses on the native stack, so with the JIT enabled
+/// the program runs on a thread with a stack large enough for maxDepth
+/// native frames.
+///
+/// With memoize set, calls of pure functions look up their arguments in a
+/// MemoTable first and add the result when they return.  Pure functions
+/// stay interpreted then, so that no call of theirs bypasses the table.
+///
+/// With profile set, the VM runs every function interpreted and reports
+/// what it does to a Profiler.  With a sampleRate, it keeps the call stack
+/// and the instruction of every interpreted frame where a Sampler can read
+/// it; native code stays on and shows up as a frame without a line.  The
+/// interpreter loop is instantiated once with these hooks and the
+/// Tracer's and once without, so a run without any does not pay for them.
+///
+/// With guard set, the Memory is guarded and a Guard turns an access to
+/// memory the program does not own into a fatal error naming the function
+/// and the line of the instruction that made it.  The accesses themselves
+/// are not checked: the interpreter only remembers the last instruction
+/// that accessed memory, and the JIT is off, since native code has no
+/// lines.
+class VM {
+public:
+   /// Size of the native stack the program runs on when the JIT is on
+   static const size_t kNativeStackBytes = size_t(1) << 30;
+private:
+   /// Calls the stacks have room for before they first grow
+   static const unsigned kInitialDepth = 1024;
+
+   /// A running call, or one waiting for its callee to return
+   struct CallFrame {
+      const Function * fn;
+      const Instr * pc;   /// where the call resumes when its callee returns
+      size_t base;        /// first register of the frame in mRegs
+      LL fp;              /// data frame
+      bool memo;          /// the result goes to the MemoTable
+   };
+
+   const Program & mProg;
+   VMOptions mOptions;
+   Environment mEnv;
+   std::vector<LL> mRegs;
+   std::vector<CallFrame> mFrames;
+
+   /// The JIT tier, created when the first function gets hot
+   JitContext mCtx;
+   std::unique_ptr<JIT> mJit;
+   std::vector<unsigned> mHeat;
+   std::vector<JIT::Entry> mNative;
+   std::vector<bool> mNoJit;
+   /// Compiled loops by function index << 32 | header
+   llvm::DenseMap<uint64_t, JIT::OsrEntry> mLoops;
+
+   /// Memoization, if it is on
+   std::unique_ptr<MemoTable> mMemo;
+   std::unique_ptr<Purity> mPurity;
+   std::vector<int8_t> mMemoizable;       /// -1 until decided
+   std::vector<LL> mMemoArgs;             /// arguments of the memoized calls running
+
+   std::unique_ptr<Profiler> mProfile;
+   std::unique_ptr<Sampler> mSampler;
+   Tracer * mTracer;                      /// if the Tracer is enabled
+
+   std::unique_ptr<Guard> mGuard;         /// if guard is set
+   const Instr * mAt;                     /// the last memory access, when guarded
+   bool mReported;
+
+   /// Push the frame of a call to \p fn whose registers start at \p base.
+   /// This may move mRegs.
+   void enter(const Function & fn, size_t base) {
+      if (mFrames.size() + mCtx.nativeDepth >= mOptions.maxDepth)
+         llvm::report_fatal_error(llvm::Twine("call depth exceeds ") +
+                                  llvm::Twine(mOptions.maxDepth) + " in " + fn.name);
+      if (base + fn.numRegs > mRegs.size()) {
+         mRegs.resize(std::max(base + fn.numRegs, 2 * mRegs.size()));
+         mCtx.regs = mRegs.data();
+      }
+      /// Variables start out zero like the rest of the program's storage
+      std::fill(mRegs.begin() + base + fn.numParams,
+                mRegs.begin() + base + fn.numSlots, 0);
+      CallFrame frame = { &fn, NULL, base, mEnv.memory().pushFrame(fn.frameBytes), false };
+      mFrames.push_back(frame);
+   }
+
+   /// Whether calls of \p fn go through the MemoTable
+   bool memoizable(int fn) {
+      if (mMemoizable[fn] < 0) {
+         mMemoizable[fn] = mProg.functions[fn].numParams <= MemoTable::kMaxArgs
+                           && mPurity->isPure(fn);
+         if (mMemoizable[fn]) mNoJit[fn] = true;
+      }
+      return mMemoizable[fn];
+   }
+
+   /// Remember the result \p val of the innermost call, a memoized one
+   void endMemo(LL val) {
+      const Function * fn = mFrames.back().fn;
+      const LL * args = mMemoArgs.data() + mMemoArgs.size() - fn->numParams;
+      mMemo->insert(fn - mProg.functions.data(), args, fn->numParams, val);
+      mMemoArgs.resize(mMemoArgs.size() - fn->numParams);
+   }
+
+   bool startJit() {
+      if (!mJit) {
+         mJit = JIT::create(mProg);
+         if (!mJit) mOptions.jit = false;
+      }
+      return mOptions.jit;
+   }
+
+   /// Native code for function \p fn if it is compiled or just got hot
+   JIT::Entry native(int fn) {
+      if (mNative[fn]) return mNative[fn];
+      if (!mOptions.jit || ++mHeat[fn] < mOptions.jitThreshold || mNoJit[fn]) return NULL;
+      if (mMemo && memoizable(fn)) return NULL;
+      if (!startJit()) return NULL;
+      mNative[fn] = mJit->compile(fn);
+      mNoJit[fn] = !mNative[fn];
+      return mNative[fn];
+   }
+
+   LL callNative(JIT::Entry entry, const LL * args) {
+      LL limit = mCtx.depthLimit;
+      mCtx.depthLimit = mOptions.maxDepth - mFrames.size() + 1;
+      LL val = entry(&mCtx, args);
+      mCtx.depthLimit = limit;
+      return val;
+   }
+
+   /// Native code for the loop of \p fn from \p header to \p backEdge.
+   /// A function whose code failed to compile once stays interpreted, so
+   /// its back-edges do not look for loops again.
+   JIT::OsrEntry loop(const Function * fn, int header, int backEdge) {
+      int index = fn - mProg.functions.data();
+      if (mNoJit[index]) return NULL;
+      uint64_t key = (uint64_t) index << 32 | header;
+      llvm::DenseMap<uint64_t, JIT::OsrEntry>::iterator it = mLoops.find(key);
+      if (it != mLoops.end()) return it->second;
+      JIT::OsrEntry entry = startJit() ? mJit->compileLoop(index, header, backEdge) : NULL;
+      if (entry) mLoops[key] = entry;
+      else mNoJit[index] = true;
+      return entry;
+   }
+
+   /// Run a compiled loop on the innermost frame, returns where to resume
+   LL callLoop(JIT::OsrEntry entry, LL fp) {
+      LL limit = mCtx.depthLimit;
+      mCtx.depthLimit = mOptions.maxDepth - mFrames.size() + 1;
+      LL resume = entry(&mCtx, mFrames.back().base, fp);
+      mCtx.depthLimit = limit;
+      return resume;
+   }
+
+   /// JitContext::call, compiled code calling a function
+   static LL callFromNative(void * owner, int fn, const LL * args) {
+      VM * vm = (VM *) owner;
+      if (vm->mMemo && vm->memoizable(fn)) {
+         const Function & callee = vm->mProg.function(fn);
+         LL val;
+         if (!vm->mMemo->lookup(fn, args, callee.numParams, val)) {
+            val = vm->execute(callee, args);
+            vm->mMemo->insert(fn, args, callee.numParams, val);
+         }
+         return val;
+      }
+      if (JIT::Entry entry = vm->native(fn)) {
+         if (!vm->mSampler && !vm->mTracer) return vm->callNative(entry, args);
+         const Function * callee = &vm->mProg.functions[fn];
+         if (vm->mSampler) vm->mSampler->push(fn, NULL);
+         if (vm->mTracer) vm->mTracer->enter(callee);
+         LL val = vm->callNative(entry, args);
+         if (vm->mTracer) vm->mTracer->leave(callee);
+         if (vm->mSampler) vm->mSampler->pop();
+         return val;
+      }
+      return vm->execute(vm->mProg.function(fn), args);
+   }
+
+   /// Run the program and flush what it PRINTed.  A process forked while
+   /// the program runs only has this thread, so nothing may be left for
+   /// the caller to do.
+   void runProgram() {
+      if (mGuard) {
+         if (sigsetjmp(mGuard->jump(), 1)) fault();
+         mGuard->arm();
+      }
+      mEnv.initGlobals(mProg.numGlobals, mProg.dataBytes);
+      mCtx.mem = mEnv.memory().base();
+      mCtx.globals = mEnv.globals();
+      if (mSampler && !mSampler->start())
+         llvm::errs() << "cannot sample: " << strerror(errno) << "\n";
+      execute(mProg.function(mProg.globalInit), NULL);
+      execute(mProg.function(mProg.entry), NULL);
+      if (mSampler) mSampler->stop();
+      if (mGuard) mGuard->disarm();
+      mEnv.flush();
+      report();
+   }
+
+   /// Report the access the Guard caught, at the line of the innermost
+   /// call's last memory access
+   [[noreturn]] void fault() {
+      mGuard->disarm();
+      std::string where = "<globals>";
+      if (!mFrames.empty()) {
+         const Function & fn = *mFrames.back().fn;
+         where = fn.name;
+         size_t at = mAt - fn.code.data();
+         if (mAt >= fn.code.data() && at < fn.lines.size())
+            where += ", line " + std::to_string(fn.lines[at]);
+      }
+      llvm::report_fatal_error(llvm::Twine("invalid memory access in ") + where + ": " +
+                               mEnv.memory().describe(mGuard->address()));
+   }
+
+   static void * runThread(void * vm) {
+      ((VM *) vm)->runProgram();
+      return NULL;
+   }
+
+   void runOnLargeStack() {
+      char * stack = (char *) mmap(NULL, kNativeStackBytes, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      pthread_attr_t attr;
+      pthread_t thread;
+      if (stack == MAP_FAILED || pthread_attr_init(&attr)) {
+         runProgram();
+         return;
+      }
+      mprotect(stack, Memory::kPageSize, PROT_NONE);
+      pthread_attr_setstack(&attr, stack, kNativeStackBytes);
+      if (pthread_create(&thread, &attr, runThread, this)) runProgram();
+      else pthread_join(thread, NULL);
+      pthread_attr_destroy(&attr);
+      munmap(stack, kNativeStackBytes);
+   }
+
+public:
+   /// A VM running \p prog with GET reading \p in and PRINT writing \p out
+   explicit VM(const Program & prog, const VMOptions & options = VMOptions(),
+               Input & in = Input::standard(), llvm::raw_ostream & out = llvm::errs())
+      : mProg(prog), mOptions(options),
+        mEnv(in, out, options.prompt, options.guard, options.memoryBytes), mRegs(),
+        mFrames(), mCtx(), mJit(), mHeat(prog.functions.size(), 0), mNative(prog.functions.size(), NULL),
+        mNoJit(prog.functions.size(), false), mLoops(), mMemo(), mPurity(),
+        mMemoizable(), mMemoArgs(), mProfile(), mSampler(), mTracer(NULL), mGuard(),
+        mAt(NULL), mReported(false) {
+      if (mOptions.guard) {
+         mGuard.reset(new Guard(mEnv.memory()));
+         mOptions.jit = false;
+      }
+      if (mOptions.profile) {
+         mProfile.reset(new Profiler(prog));
+         mOptions.jit = false;
+      }
+      if (mOptions.sampleRate) mSampler.reset(new Sampler(prog, mOptions.sampleRate));
+      if (Tracer::instance().enabled()) {
+         mTracer = &Tracer::instance();
+         mEnv.setTracer(mTracer);
+      }
+      if (mOptions.memoize) {
+         mMemo.reset(new MemoTable(mOptions.memoEntries));
+         mPurity.reset(new Purity(prog));
+         mMemoizable.assign(prog.functions.size(), -1);
+      }
+      unsigned frameRegs = 0;
+      for (const Function & fn : prog.functions)
+         frameRegs = std::max(frameRegs, fn.numRegs);
+      size_t frames = mOptions.maxDepth < kInitialDepth ? mOptions.maxDepth : kInitialDepth;
+      mRegs.resize(frames * frameRegs);
+      mFrames.reserve(frames);
+      mCtx.regs = mRegs.data();
+      mCtx.env = &mEnv;
+      mCtx.owner = this;
+      mCtx.call = callFromNative;
+   }
+
+   /// Initialize the globals and run main, then flush what it PRINTed
+   void run() {
+      if (mOptions.jit) runOnLargeStack();
+      else runProgram();
+   }
+
+   /// Report what the run did so far, the memo and heap stats, the profile
+   /// and the samples it was asked for, unless that happened before.  A
+   /// run reports when main returns, or earlier if it calls this itself.
+   void report() {
+      if (mReported) return;
+      mReported = true;
+      if (mSampler) mSampler->stop();
+      if (mMemo && mOptions.memoStats) mMemo->stats().print(llvm::errs());
+      if (mOptions.heapStats) mEnv.memory().stats().print(llvm::errs());
+      if (mProfile) {
+         mProfile->report(llvm::errs());
+         if (!mOptions.profileFile.empty() && !mProfile->write(mOptions.profileFile))
+            llvm::errs() << mOptions.profileFile << ": cannot write the profile\n";
+      }
+      if (mSampler) {
+         llvm::errs() << "sampler: " << mSampler->samples() << " samples, "
+                      << mSampler->dropped() << " dropped\n";
+         if (!mOptions.sampleFile.empty() && !mSampler->write(mOptions.sampleFile))
+            llvm::errs() << mOptions.sampleFile << ": cannot write the samples\n";
+      }
+   }
+
+   /// Like run(), but on the caller's stack, which needs kNativeStackBytes
+   /// of room if the JIT is on
+   void runInPlace() {
+      runProgram();
+   }
+
+   /// Interpret \p fn with the arguments \p args, which must not point
+   /// into the register stack, until it returns.  Without \p args the
+   /// parameters are zero.  Calls of interpreted code do not come back
+   /// here, so this only nests when native code calls a function that is
+   /// not compiled.
+   LL execute(const Function & fn, const LL * args) {
+      if (mProfile || mSampler || mTracer) return interpret<true>(fn, args);
+      return interpret<false>(fn, args);
+   }
+
+private:
+   template <bool Instrumented>
+   LL interpret(const Function & fn, const LL * args) {
+      const bool profiling = Instrumented && mProfile;
+      const bool sampling = Instrumented && mSampler;
+      const bool tracing = Instrumented && mTracer;
+      const bool guarding = mGuard.get() != NULL;
+      size_t stop = mFrames.size();
+      size_t base = stop ? mFrames.back().base + mFrames.back().fn->numRegs : 0;
+      enter(fn, base);
+      uint64_t * counts = profiling ? mProfile->enter(&fn - mProg.functions.data()) : NULL;
+      const Instr * volatile * at =
+         sampling ? mSampler->push(&fn - mProg.functions.data(), fn.code.data()) : NULL;
+      if (tracing) mTracer->enter(&fn);
+      /// main is called without arguments, whatever parameters it declares
+      if (args) std::copy(args, args + fn.numParams, mRegs.begin() + base);
+      else std::fill(mRegs.begin() + base, mRegs.begin() + base + fn.numParams, 0);
+      LL * globals = mEnv.globals();
+      char * mem = mEnv.memory().base();
+      const Function * cur = &fn;
+      const Instr * code = cur->code.data();
+      const LL * consts = cur->consts.data();
+      LL * regs = mRegs.data() + base;
+      LL fp = mFrames.back().fp;
+      unsigned * heat = &mHeat[cur - mProg.functions.data()];
+
+/// A taken branch.  Jumping backwards ends a loop iteration, in a hot
+/// function the loop continues in native code.
+#define BRANCH(target) do { \
+            const Instr * to = code + (target); \
+            if (tracing && to < pc) mTracer->loop(cur, to - code); \
+            if (to < pc && ++*heat >= mOptions.jitThreshold && mOptions.jit) { \
+               if (JIT::OsrEntry entry = loop(cur, to - code, pc - 1 - code)) { \
+                  to = code + callLoop(entry, fp); \
+                  regs = mRegs.data() + mFrames.back().base; \
+               } \
+            } \
+            pc = to; \
+         } while (0)
+
+      for (const Instr * pc = code; ; ) {
+         if (profiling) ++counts[pc - code];
+         if (sampling) *at = pc;
+         const Instr & I = *pc++;
+         switch (I.op) {
+         case OP_NOP: break;
+         case OP_LOADK: regs[I.a] = consts[I.b]; break;
+         case OP_MOV: regs[I.a] = regs[I.b]; break;
+         case OP_LOADGLOBAL: regs[I.a] = globals[I.b]; break;
+         case OP_STOREGLOBAL: globals[I.a] = regs[I.b]; break;
+         case OP_FRAMEADDR: regs[I.a] = fp + I.b; break;
+/// An instruction accessing memory, which a guarded run remembers
+#define ACCESS(stmt) do { if (guarding) mAt = &I; stmt; } while (0)
+         case OP_ZERO: ACCESS(mEnv.memory().zero(regs[I.a], I.b)); break;
+         case OP_LOAD8: ACCESS(regs[I.a] = Memory::load8(mem + regs[I.b])); break;
+         case OP_LOAD32: ACCESS(regs[I.a] = Memory::load32(mem + regs[I.b])); break;
+         case OP_LOAD64: ACCESS(regs[I.a] = Memory::load64(mem + regs[I.b])); break;
+         case OP_STORE8: ACCESS(Memory::store8(mem + regs[I.a], regs[I.b])); break;
+         case OP_STORE32: ACCESS(Memory::store32(mem + regs[I.a], regs[I.b])); break;
+         case OP_STORE64: ACCESS(Memory::store64(mem + regs[I.a], regs[I.b])); break;
+         case OP_VEC32:
+            ACCESS(regs[I.a] = Vector::run(mem, I.c, regs[I.a], regs[I.b], regs[I.b + 1],
+                                           regs[I.b + 2], regs[I.b + 3]));
+            break;
+#undef ACCESS
+         case OP_SEXT8: regs[I.a] = (int8_t) regs[I.b]; break;
+         case OP_SEXT32: regs[I.a] = (int32_t) regs[I.b]; break;
+         case OP_NEG: regs[I.a] = -regs[I.b]; break;
+         case OP_NOT: regs[I.a] = ~regs[I.b]; break;
+         case OP_LNOT: regs[I.a] = !regs[I.b]; break;
+         case OP_ADD: regs[I.a] = regs[I.b] + regs[I.c]; break;
+         case OP_SUB: regs[I.a] = regs[I.b] - regs[I.c]; break;
+         case OP_MUL: regs[I.a] = regs[I.b] * regs[I.c]; break;
+         case OP_DIV: regs[I.a] = regs[I.b] / regs[I.c]; break;
+         case OP_REM: regs[I.a] = regs[I.b] % regs[I.c]; break;
+         /// Shift counts wrap at 64 in every tier, like the host's shifts
+         case OP_SHL: regs[I.a] = (LL) ((uint64_t) regs[I.b] << (regs[I.c] & 63)); break;
+         case OP_SHR: regs[I.a] = regs[I.b] >> (regs[I.c] & 63); break;
+         case OP_AND: regs[I.a] = regs[I.b] & regs[I.c]; break;
+         case OP_OR: regs[I.a] = regs[I.b] | regs[I.c]; break;
+         case OP_XOR: regs[I.a] = regs[I.b] ^ regs[I.c]; break;
+         case OP_LT: regs[I.a] = regs[I.b] < regs[I.c]; break;
+         case OP_GT: regs[I.a] = regs[I.b] > regs[I.c]; break;
+         case OP_LE: regs[I.a] = regs[I.b] <= regs[I.c]; break;
+         case OP_GE: regs[I.a] = regs[I.b] >= regs[I.c]; break;
+         case OP_EQ: regs[I.a] = regs[I.b] == regs[I.c]; break;
+         case OP_NE: regs[I.a] = regs[I.b] != regs[I.c]; break;
+         case OP_JMP: BRANCH(I.a); break;
+         case OP_JZ: if (!regs[I.a]) BRANCH(I.b); break;
+         case OP_JNZ: if (regs[I.a]) BRANCH(I.b); break;
+         case OP_ADDK: regs[I.a] = regs[I.b] + I.c; break;
+         case OP_MULK: regs[I.a] = regs[I.b] * I.c; break;
+         case OP_JLT: if (regs[I.a] < regs[I.b]) BRANCH(I.c); break;
+         case OP_JGT: if (regs[I.a] > regs[I.b]) BRANCH(I.c); break;
+         case OP_JLE: if (regs[I.a] <= regs[I.b]) BRANCH(I.c); break;
+         case OP_JGE: if (regs[I.a] >= regs[I.b]) BRANCH(I.c); break;
+         case OP_JEQ: if (regs[I.a] == regs[I.b]) BRANCH(I.c); break;
+         case OP_JNE: if (regs[I.a] != regs[I.b]) BRANCH(I.c); break;
+         case OP_JLTK: if (regs[I.a] < I.b) BRANCH(I.c); break;
+         case OP_JGTK: if (regs[I.a] > I.b) BRANCH(I.c); break;
+         case OP_JLEK: if (regs[I.a] <= I.b) BRANCH(I.c); break;
+         case OP_JGEK: if (regs[I.a] >= I.b) BRANCH(I.c); break;
+         case OP_JEQK: if (regs[I.a] == I.b) BRANCH(I.c); break;
+         case OP_JNEK: if (regs[I.a] != I.b) BRANCH(I.c); break;
+         case OP_CALL: {
+            bool memo = mMemo && memoizable(I.b);
+            if (memo) {
+               const Function & callee = mProg.function(I.b);
+               if (mMemo->lookup(I.b, regs + I.c, callee.numParams, regs[I.a])) break;
+               mMemoArgs.insert(mMemoArgs.end(), regs + I.c, regs + I.c + callee.numParams);
+            } else if (JIT::Entry entry = native(I.b)) {
+               /// Native code may interpret calls of its own and move mRegs
+               if (sampling) mSampler->push(I.b, NULL);
+               if (tracing) mTracer->enter(&mProg.functions[I.b]);
+               LL val = callNative(entry, regs + I.c);
+               if (tracing) mTracer->leave(&mProg.functions[I.b]);
+               if (sampling) mSampler->pop();
+               regs = mRegs.data() + mFrames.back().base;
+               regs[I.a] = val;
+               break;
+            }
+            /// The callee's frame overlays the caller's argument registers
+            const Function & callee = mProg.function(I.b);
+            size_t calleeBase = mFrames.back().base + I.c;
+            mFrames.back().pc = pc;
+            enter(callee, calleeBase);
+            mFrames.back().memo = memo;
+            if (profiling) counts = mProfile->enter(I.b);
+            if (sampling) at = mSampler->push(I.b, callee.code.data());
+            if (tracing) mTracer->enter(&callee);
+            cur = &callee;
+            code = cur->code.data();
+            consts = cur->consts.data();
+            regs = mRegs.data() + calleeBase;
+            fp = mFrames.back().fp;
+            heat = &mHeat[I.b];
+            pc = code;
+            break;
+         }
+         case OP_RET:
+         case OP_RETVOID: {
+            LL val = I.op == OP_RET ? regs[I.a] : 0;
+            if (mFrames.back().memo) endMemo(val);
+            mEnv.memory().popFrame(cur->frameBytes);
+            mFrames.pop_back();
+            if (profiling) counts = mProfile->leave();
+            if (sampling) at = mSampler->pop();
+            if (tracing) mTracer->leave(cur);
+            if (mFrames.size() == stop) return val;
+            const CallFrame & caller = mFrames.back();
+            cur = caller.fn;
+            code = cur->code.data();
+            consts = cur->consts.data();
+            regs = mRegs.data() + caller.base;
+            fp = caller.fp;
+            heat = &mHeat[cur - mProg.functions.data()];
+            pc = caller.pc;
+            /// The CALL just before the resume point names the result register
+            regs[pc[-1].a] = val;
+            break;
+         }
+         case OP_GET: regs[I.a] = mEnv.input(); break;
+         case OP_PRINT:
+            if (DEBUG) mEnv.dumpStack();
+            mEnv.output(regs[I.a]);
+            break;
+         case OP_MALLOC: regs[I.a] = mEnv.allocate(regs[I.b]); break;
+         case OP_FREE: mEnv.deallocate(regs[I.a]); break;
+         default:
+            assert("unknown opcode" && 0);
+            return 0;
+         }
+      }
+#undef BRANCH
+   }
+};
+
+#endif
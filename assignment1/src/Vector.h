@@ -0,0 +1,184 @@
+//==--- Vector.h - SIMD kernels of element-wise int array loops ------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_VECTOR_H
+#define AST_INTERPRETER_VECTOR_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_X86 1
+#define VECTOR_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VECTOR_X86 0
+#endif
+
+#include "Bytecode.h"
+#include "Memory.h"
+
+/// Runs the loops the Compiler lowers to OP_VEC32,
+///
+///    for (; i < n; ++i) dst[i] = x op y;
+///
+/// over arrays of 4-byte ints, where x and y are either elements x[i] and
+/// y[i] or values that stay the same throughout, and op is one of add,
+/// sub, mul, and, or and xor, or mov for dst[i] = x.  The ints wrap like
+/// the interpreter's own 64-bit arithmetic stored back to an int does.
+///
+/// A loop runs 8 elements at a time with AVX2 or 4 with SSE4.1, whichever
+/// the CPU has, and one at a time otherwise and for what is left over.  A
+/// source array that starts below dst and overlaps it would see the
+/// elements earlier iterations stored, so such a loop runs one element at
+/// a time in order, exactly like the interpreted loop.
+class Vector {
+public:
+   /// kind of OP_VEC32: the opcode in the low byte and which operands are
+   /// arrays
+   static const int kOpMask = 0xff;
+   static const int kArrayX = 1 << 8;
+   static const int kArrayY = 1 << 9;
+
+   enum Level { Scalar, Sse41, Avx2 };
+
+   /// The widest instructions the CPU has
+   static Level best() {
+      static const Level level = detect();
+      return level;
+   }
+
+   /// Run the loop of \p kind from \p i up to \p n in \p mem, an operand
+   /// being the interpreter address of its array or its value, and return
+   /// the final i
+   static LL run(char * mem, int kind, LL i, LL n, LL dst, LL x, LL y, Level level = best()) {
+      if (i >= n) return i;
+      LL count = n - i;
+      char * d = mem + dst + 4 * i;
+      const char * xs = kind & kArrayX ? mem + x + 4 * i : NULL;
+      const char * ys = kind & kArrayY ? mem + y + 4 * i : NULL;
+      if (overlaps(xs, d, count) || overlaps(ys, d, count)) level = Scalar;
+      switch (kind & kOpMask) {
+      case OP_MOV: dispatch<OP_MOV>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_ADD: dispatch<OP_ADD>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_SUB: dispatch<OP_SUB>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_MUL: dispatch<OP_MUL>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_AND: dispatch<OP_AND>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_OR: dispatch<OP_OR>(kind, level, d, xs, x, ys, y, count); break;
+      case OP_XOR: dispatch<OP_XOR>(kind, level, d, xs, x, ys, y, count); break;
+      default:
+         llvm::report_fatal_error("unknown vector loop");
+      }
+      return n;
+   }
+
+private:
+   static Level detect() {
+#if VECTOR_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) return Avx2;
+      if (__builtin_cpu_supports("sse4.1")) return Sse41;
+#endif
+      return Scalar;
+   }
+
+   /// Whether \p src starts below \p d and reaches into it
+   static bool overlaps(const char * src, const char * d, LL count) {
+      return src && src < d && d < src + 4 * count;
+   }
+
+   template <Opcode Op>
+   static int32_t apply(int32_t x, int32_t y) {
+      uint32_t a = x, b = y;
+      switch (Op) {
+      case OP_ADD: return a + b;
+      case OP_SUB: return a - b;
+      case OP_MUL: return a * b;
+      case OP_AND: return a & b;
+      case OP_OR: return a | b;
+      case OP_XOR: return a ^ b;
+      default: return a;
+      }
+   }
+
+   /// One element at a time, loading every operand right before its use
+   template <Opcode Op, bool ArrayX, bool ArrayY>
+   static void scalar(char * d, const char * xs, LL x, const char * ys, LL y, LL count) {
+      for (LL j = 0; j < count; ++j) {
+         int32_t a = ArrayX ? Memory::load32(xs + 4 * j) : (int32_t) x;
+         int32_t b = ArrayY ? Memory::load32(ys + 4 * j) : (int32_t) y;
+         Memory::store32(d + 4 * j, apply<Op>(a, b));
+      }
+   }
+
+#if VECTOR_X86
+   template <Opcode Op, bool ArrayX, bool ArrayY>
+   VECTOR_TARGET("sse4.1")
+   static void sse41(char * d, const char * xs, LL x, const char * ys, LL y, LL count) {
+      const __m128i bx = _mm_set1_epi32((int32_t) x), by = _mm_set1_epi32((int32_t) y);
+      LL j = 0;
+      for (; j + 4 <= count; j += 4) {
+         __m128i a = ArrayX ? _mm_loadu_si128((const __m128i *) (xs + 4 * j)) : bx;
+         __m128i b = ArrayY ? _mm_loadu_si128((const __m128i *) (ys + 4 * j)) : by;
+         __m128i r;
+         switch (Op) {
+         case OP_ADD: r = _mm_add_epi32(a, b); break;
+         case OP_SUB: r = _mm_sub_epi32(a, b); break;
+         case OP_MUL: r = _mm_mullo_epi32(a, b); break;
+         case OP_AND: r = _mm_and_si128(a, b); break;
+         case OP_OR: r = _mm_or_si128(a, b); break;
+         case OP_XOR: r = _mm_xor_si128(a, b); break;
+         default: r = a; break;
+         }
+         _mm_storeu_si128((__m128i *) (d + 4 * j), r);
+      }
+      scalar<Op, ArrayX, ArrayY>(d + 4 * j, ArrayX ? xs + 4 * j : NULL, x,
+                                 ArrayY ? ys + 4 * j : NULL, y, count - j);
+   }
+
+   template <Opcode Op, bool ArrayX, bool ArrayY>
+   VECTOR_TARGET("avx2")
+   static void avx2(char * d, const char * xs, LL x, const char * ys, LL y, LL count) {
+      const __m256i bx = _mm256_set1_epi32((int32_t) x), by = _mm256_set1_epi32((int32_t) y);
+      LL j = 0;
+      for (; j + 8 <= count; j += 8) {
+         __m256i a = ArrayX ? _mm256_loadu_si256((const __m256i *) (xs + 4 * j)) : bx;
+         __m256i b = ArrayY ? _mm256_loadu_si256((const __m256i *) (ys + 4 * j)) : by;
+         __m256i r;
+         switch (Op) {
+         case OP_ADD: r = _mm256_add_epi32(a, b); break;
+         case OP_SUB: r = _mm256_sub_epi32(a, b); break;
+         case OP_MUL: r = _mm256_mullo_epi32(a, b); break;
+         case OP_AND: r = _mm256_and_si256(a, b); break;
+         case OP_OR: r = _mm256_or_si256(a, b); break;
+         case OP_XOR: r = _mm256_xor_si256(a, b); break;
+         default: r = a; break;
+         }
+         _mm256_storeu_si256((__m256i *) (d + 4 * j), r);
+      }
+      scalar<Op, ArrayX, ArrayY>(d + 4 * j, ArrayX ? xs + 4 * j : NULL, x,
+                                 ArrayY ? ys + 4 * j : NULL, y, count - j);
+   }
+#endif
+
+   template <Opcode Op, bool ArrayX, bool ArrayY>
+   static void kernel(Level level, char * d, const char * xs, LL x, const char * ys, LL y,
+                      LL count) {
+#if VECTOR_X86
+      if (level == Avx2) return avx2<Op, ArrayX, ArrayY>(d, xs, x, ys, y, count);
+      if (level == Sse41) return sse41<Op, ArrayX, ArrayY>(d, xs, x, ys, y, count);
+#endif
+      scalar<Op, ArrayX, ArrayY>(d, xs, x, ys, y, count);
+   }
+
+   template <Opcode Op>
+   static void dispatch(int kind, Level level, char * d, const char * xs, LL x,
+                        const char * ys, LL y, LL count) {
+      switch (kind & (kArrayX | kArrayY)) {
+      case kArrayX | kArrayY: kernel<Op, true, true>(level, d, xs, x, ys, y, count); break;
+      case kArrayX: kernel<Op, true, false>(level, d, xs, x, ys, y, count); break;
+      case kArrayY: kernel<Op, false, true>(level, d, xs, x, ys, y, count); break;
+      default: kernel<Op, false, false>(level, d, xs, x, ys, y, count); break;
+      }
+   }
+};
+
+#endif
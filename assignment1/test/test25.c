@@ -0,0 +1,27 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   char* s;
+   int* a;
+   int i;
+   s = (char *)MALLOC(8);
+   a = (int *)MALLOC(sizeof(int) * 2);
+
+   for (i = 0; i < 8; i = i + 1) {
+      s[i] = i * 40;
+   }
+   *a = s[7];
+   *(a + 1) = s[1] + s[2];
+
+   PRINT(*a);
+   PRINT(*(a + 1));
+   FREE(s);
+   FREE(a);
+   return 0;
+}
+
+#24
+#120
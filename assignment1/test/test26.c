@@ -0,0 +1,37 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int g[3][4];
+
+void swap(int *x, int *y) {
+   int t;
+   t = *x;
+   *x = *y;
+   *y = t;
+}
+
+int main() {
+   int a[4][5];
+   int i;
+   int j;
+   int s;
+   s = 0;
+   for (i = 0; i < 4; i = i + 1) {
+      for (j = 0; j < 5; j = j + 1) {
+         a[i][j] = i * j;
+      }
+   }
+   for (i = 0; i < 3; i = i + 1) {
+      g[i][i] = a[3][4] + i;
+   }
+   i = 7;
+   j = 9;
+   swap(&i, &j);
+   s = g[2][2] + g[1][2] + i - j;
+   PRINT(s);
+   return 0;
+}
+
+#16
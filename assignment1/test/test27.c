@@ -0,0 +1,30 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int i;
+   int j;
+   int n;
+   n = 0;
+   for (i = 0; i < 100 && !(i > 50 || i == 40); i = i + 1) {
+      if (i % 2 == 0 || i % 3 == 0)
+         continue;
+      n = n + 1;
+   }
+   j = 0;
+   while (1) {
+      j = j + 1;
+      if (j > 10 && n > 0)
+         break;
+   }
+   i = 0;
+   do {
+      i = i + 2;
+   } while (i < j && i != 8);
+   PRINT(n * 100 + j + i);
+   return 0;
+}
+
+#1319
@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int depth(int n) {
+   int a[2];
+   if (n == 0)
+      return 0;
+   a[1] = depth(n - 1);
+   return a[1] + 1;
+}
+
+int main() {
+   PRINT(depth(200000));
+   return 0;
+}
+
+#200000
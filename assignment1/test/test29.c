@@ -0,0 +1,35 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int scale(int x) {
+   int unused;
+   unused = x * 1000;
+   unused = 3;
+   return x * (2 + 3) - unused;
+}
+
+int main() {
+   int i;
+   int s;
+   int small;
+   int k;
+   k = (6 * 7 - 2) / 4 % 7 << 1;
+   s = 1 - 1;
+   for (i = 0; i < 20; i = i + 1) {
+      small = i < k;
+      if (small)
+         s = s + scale(i);
+      else if (i * 2 >= 30 == 0)
+         s = s - (1 << 3);
+      else
+         s = s + (i & 3 | 8 ^ 1);
+   }
+   if (k == 6 && 2 > 3)
+      s = 0;
+   PRINT(s);
+   return 0;
+}
+
+#36
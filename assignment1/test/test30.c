@@ -0,0 +1,30 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int square(int x) {
+   return x * x;
+}
+
+int sum(int n) {
+   int i;
+   int s;
+   s = 0;
+   for (i = 1; i <= n; i = i + 1)
+      s = s + square(i);
+   return s;
+}
+
+int fib(int n) {
+   if (n < 2)
+      return n;
+   return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+   PRINT(sum(10) + fib(15));
+   return 0;
+}
+
+#995
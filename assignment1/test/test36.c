@@ -0,0 +1,62 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int a[19];
+int b[19];
+int c[19];
+
+int sum(int * p, int n) {
+   int i;
+   int s;
+   s = 0;
+   for (i = 0; i < n; i = i + 1)
+      s = s + p[i] * (i + 1);
+   return s;
+}
+
+int main() {
+   int i;
+   int k;
+   int n;
+   int * p;
+   int * q;
+   n = 19;
+   for (i = 0; i < n; i = i + 1) {
+      b[i] = i * 3;
+      c[i] = 100 - i;
+   }
+   // 19 elements, not a multiple of the vector width
+   for (i = 0; i < n; i++)
+      a[i] = b[i] + c[i];
+   PRINT(sum(a, n));
+   PRINT(i);
+   k = 5;
+   for (i = 0; i < n; ++i)
+      a[i] += k;
+   for (i = 3; i < 17; i += 1)
+      a[i] = a[i] ^ 6;
+   PRINT(sum(a, n));
+   PRINT(i);
+
+   p = (int *) MALLOC(4 * 21);
+   for (i = 0; i < 21; i = i + 1)
+      p[i] = i + 1;
+   // Shifted down by one, element by element
+   for (i = 0; i < 20; i = i + 1)
+      p[i] = p[i + 1];
+   // Again, the source starting above the destination
+   q = p + 1;
+   for (i = 0; i < 19; i = i + 1)
+      p[i] = q[i];
+   PRINT(sum(p, 21));
+   // The source below the destination: p[0] spreads up like it does
+   // one element at a time
+   for (i = 0; i < 19; i = i + 1)
+      q[i] = p[i];
+   PRINT(sum(p, 21));
+   PRINT(i);
+   FREE(p);
+   return 0;
+}
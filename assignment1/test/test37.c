@@ -0,0 +1,32 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+char g;
+
+int main() {
+   char c;
+   char d;
+   char * p;
+   c = 127;
+   c++;
+   PRINT(c);
+   d = -128;
+   --d;
+   PRINT(d);
+   c = 100;
+   c += 100;
+   PRINT(c);
+   PRINT(c += 100);
+   g = 120;
+   g *= 3;
+   PRINT(g);
+   PRINT(g++);
+   PRINT(g);
+   p = (char *) MALLOC(8);
+   *p = 127;
+   PRINT(++*p);
+   FREE(p);
+   return 0;
+}
@@ -0,0 +1,14 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int twice(int x) {
+   return x + x;
+}
+
+int main(int argc, char ** argv) {
+   argc = 21;
+   PRINT(twice(argc));
+   return 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+#ast-interpreter "`cat $1`"
+
+# The graded tests are in ../test, which holds nothing but them
+cd "$(dirname "$0")"
+TEST=../test
+
+index=(00 01 02 03 04 05 06 07 08 09 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 36 37 38)
+
+#for id in ${index[@]}
+#do
+#	echo running on test${id}.c:
+#	ast-interpreter "`cat test${id}.c`"
+#	echo
+#done
+
+result=(100 10 20 200 10 10 20 10 20 20 5 100 4 20 12 -8 30 10 10,20 10,20 5 11 42 24,42 720 24,120 16 1319 200000 23560,19,24528,17,3711,1071,19 -128,127,-56,44,104,104,105,-128 42)
+
+for((i=0;i<${#index[@]};i++))
+do
+    echo running on test${index[i]}.c
+    echo acc = ${result[i]}
+    ast-interpreter "`cat $TEST/test${index[i]}.c`"
+    echo
+done
+
+# Programs run with options; what a program PRINTs does not depend on them
+flagIndex=(29 29 30 31)
+flags=("" "--no-optimize" "--jit-threshold=1" "--memoize --memo-stats")
+flagResult=(36 36 995 "75025memo: 49 calls, 23 hits (46%), 26 misses, 0 evictions")
+
+for((i=0;i<${#flagIndex[@]};i++))
+do
+    echo running on test${flagIndex[i]}.c ${flags[i]}
+    echo acc = ${flagResult[i]}
+    ast-interpreter ${flags[i]} "`cat $TEST/test${flagIndex[i]}.c`"
+    echo
+done
+
+# A batch whose runs wait for their input interleaved on one thread
+echo running on interleave.txt --interleave
+echo acc = "test33.c input33a.txt: 15 / test33.c input33b.txt: 100 / test33.c: 0"
+ast-interpreter --no-prompt --interleave --memory-size=64 --batch interleave.txt
+echo
+
+# One run of a program forked at its first GET for every input
+echo running on test34.c --fork-inputs forks.txt
+echo acc = "input33a.txt: 49504952 / input33b.txt: 49507350"
+ast-interpreter --fork-inputs forks.txt "`cat test34.c`"
+echo
+
+# FREEing a block twice is an error of the program, which stops the run
+echo running on test35.c
+echo acc = "LLVM ERROR: FREE of a block that was already FREEd"
+ast-interpreter "`cat test35.c`"
+echo
+
+# Every test in one process; test32.c cannot be lowered, which fails its
+# own line only
+echo running on batch.txt
+echo acc = "one line per test with the results above / test32.c: error: cannot compile: cannot lower pick: unsupported construct: SwitchStmt"
+ast-interpreter --batch batch.txt
+echo
@@ -0,0 +1,18 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int pick(int x) {
+   switch (x) {
+   case 1:
+      return 10;
+   }
+   return 0;
+}
+
+int main() {
+   PRINT(1);
+   PRINT(pick(1));
+   return 0;
+}
@@ -0,0 +1,17 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int x;
+   int s;
+   s = 0;
+   x = GET();
+   while (x != 0) {
+      s = s + x;
+      x = GET();
+   }
+   PRINT(s);
+   return 0;
+}
@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int i;
+   int p;
+   int a;
+   int b;
+   p = 0;
+   for (i = 0; i < 100; i = i + 1)
+      p = p + i;
+   PRINT(p);
+   a = GET();
+   b = GET();
+   PRINT(a * b + p);
+   return 0;
+}
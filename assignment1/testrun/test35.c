@@ -0,0 +1,18 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int * a;
+   int * b;
+   a = (int *) MALLOC(40);
+   b = (int *) MALLOC(40);
+   a[0] = 1;
+   b[0] = 2;
+   FREE(a);
+   FREE(b);
+   FREE(a);
+   PRINT(a[0] + b[0]);
+   return 0;
+}